@@ -0,0 +1,203 @@
+/**
+ * @file benchmarks/bench_menu.cpp
+ * @brief Benchmarks for building and updating the Qt tray menu.
+ */
+// standard includes
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+// lib includes
+#include <benchmark/benchmark.h>
+
+// qt includes
+#include <QAction>
+#include <QApplication>
+#include <QByteArray>
+#include <QMenu>
+
+// local includes
+#include "src/QtTrayMenu.h"
+#include "src/tray.h"
+
+namespace {
+  constexpr std::int64_t MAX_DEPTH = 6;
+
+  void noop_cb([[maybe_unused]] struct tray_menu *item) {
+    // Benchmarks never click, the callback only makes items look like real ones
+  }
+
+  /**
+   * @brief Menu tree with a given number of items spread over a given number of levels.
+   *
+   * Every level holds an equal share of the items and the last level the rest, so the tree holds
+   * exactly the requested number of items; the first item of each level opens the next one.
+   */
+  class MenuTree {
+  public:
+    MenuTree(const std::int64_t itemCount, const std::int64_t depth) {
+      const auto perLevel = static_cast<std::size_t>(std::max<std::int64_t>(1, itemCount / depth));
+      const auto lastLevel = static_cast<std::size_t>(std::max<std::int64_t>(1, itemCount - static_cast<std::int64_t>(perLevel) * (depth - 1)));
+      levels_.resize(static_cast<std::size_t>(depth));
+      texts_.reserve(perLevel * (levels_.size() - 1) + lastLevel);
+      for (auto &level : levels_) {
+        const std::size_t count = &level == &levels_.back() ? lastLevel : perLevel;
+        level.reserve(count + 1);
+        for (std::size_t i = 0; i < count; i++) {
+          texts_.push_back("Item " + std::to_string(texts_.size()));
+          struct tray_menu &item = level.emplace_back();
+          item.text = texts_.back().c_str();
+          item.checkbox = static_cast<int>(i % 2);
+          item.cb = noop_cb;
+        }
+        level.emplace_back();
+      }
+      for (std::size_t i = 0; i + 1 < levels_.size(); i++) {
+        levels_[i][0].submenu = levels_[i + 1].data();
+      }
+    }
+
+    struct tray_menu *root() {
+      return levels_.front().data();
+    }
+
+  private:
+    std::vector<std::string> texts_;
+    std::vector<std::vector<struct tray_menu>> levels_;
+  };
+
+  void openAll(QMenu *menu) {
+    emit menu->aboutToShow();
+    for (const QAction *action : menu->actions()) {
+      if (QMenu *submenu = action->menu(); submenu != nullptr) {
+        openAll(submenu);
+      }
+    }
+  }
+
+  void applyMenuArgs(benchmark::internal::Benchmark *benchmark) {
+    benchmark->ArgNames({"items", "depth"});
+    for (const std::int64_t items : {10, 100, 1000, 10000}) {
+      for (std::int64_t depth = 1; depth <= MAX_DEPTH; depth++) {
+        benchmark->Args({items, depth});
+      }
+    }
+  }
+
+  void reportStats(benchmark::State &state, const QtTrayMenu &trayMenu) {
+    const auto &stats = trayMenu.stats();
+    state.counters["actions_created"] = static_cast<double>(stats.menu_actions_created);
+    state.counters["actions_reused"] = static_cast<double>(stats.menu_actions_reused);
+    state.counters["menus_skipped"] = static_cast<double>(stats.menus_skipped);
+  }
+}  // namespace
+
+/**
+ * @brief Build the menu from scratch, as tray_init() does.
+ */
+static void BM_MenuInit(benchmark::State &state) {
+  MenuTree tree(state.range(0), state.range(1));
+  for (auto _ : state) {
+    state.PauseTiming();
+    auto trayMenu = std::make_unique<QtTrayMenu>();
+    state.ResumeTiming();
+
+    trayMenu->updateMenu(tree.root());
+
+    state.PauseTiming();
+    trayMenu.reset();
+    state.ResumeTiming();
+  }
+}
+
+BENCHMARK(BM_MenuInit)->Apply(applyMenuArgs);
+
+/**
+ * @brief Build the menu from scratch and open every submenu.
+ */
+static void BM_MenuInitExpanded(benchmark::State &state) {
+  MenuTree tree(state.range(0), state.range(1));
+  for (auto _ : state) {
+    state.PauseTiming();
+    auto trayMenu = std::make_unique<QtTrayMenu>();
+    state.ResumeTiming();
+
+    trayMenu->updateMenu(tree.root());
+    openAll(trayMenu->contextMenu());
+
+    state.PauseTiming();
+    trayMenu.reset();
+    state.ResumeTiming();
+  }
+}
+
+BENCHMARK(BM_MenuInitExpanded)->Apply(applyMenuArgs);
+
+/**
+ * @brief Update a fully opened menu without any change, as a redundant tray_update() does.
+ */
+static void BM_MenuUpdateUnchanged(benchmark::State &state) {
+  MenuTree tree(state.range(0), state.range(1));
+  QtTrayMenu trayMenu;
+  trayMenu.updateMenu(tree.root());
+  openAll(trayMenu.contextMenu());
+  for (auto _ : state) {
+    trayMenu.updateMenu(tree.root());
+  }
+  reportStats(state, trayMenu);
+}
+
+BENCHMARK(BM_MenuUpdateUnchanged)->Apply(applyMenuArgs);
+
+/**
+ * @brief Flip one checkbox of a fully opened menu and update it, then reopen the menu.
+ */
+static void BM_MenuUpdateToggle(benchmark::State &state) {
+  MenuTree tree(state.range(0), state.range(1));
+  QtTrayMenu trayMenu;
+  trayMenu.updateMenu(tree.root());
+  openAll(trayMenu.contextMenu());
+  struct tray_menu *toggled = tree.root();
+  for (auto _ : state) {
+    toggled->checked = !toggled->checked;
+    trayMenu.updateMenu(tree.root());
+    openAll(trayMenu.contextMenu());
+  }
+  reportStats(state, trayMenu);
+}
+
+BENCHMARK(BM_MenuUpdateToggle)->Apply(applyMenuArgs);
+
+/**
+ * @brief Run the benchmarks headless and write the results as JSON.
+ *
+ * Results go to tray_bench.json unless `--benchmark_out` is given.
+ */
+int main(int argc, char **argv) {
+  if (qgetenv("QT_QPA_PLATFORM").isEmpty()) {
+    qputenv("QT_QPA_PLATFORM", QByteArrayLiteral("offscreen"));
+  }
+  QApplication app(argc, argv);
+
+  std::vector<char *> args(argv, argv + argc);
+  std::string outArg = "--benchmark_out=tray_bench.json";
+  std::string formatArg = "--benchmark_out_format=json";
+  if (std::none_of(args.begin(), args.end(), [](const char *arg) {
+        return std::strncmp(arg, "--benchmark_out=", std::strlen("--benchmark_out=")) == 0;
+      })) {
+    args.push_back(outArg.data());
+    args.push_back(formatArg.data());
+  }
+  int benchmarkArgc = static_cast<int>(args.size());
+
+  benchmark::Initialize(&benchmarkArgc, args.data());
+  if (benchmark::ReportUnrecognizedArguments(benchmarkArgc, args.data())) {
+    return 1;
+  }
+  benchmark::RunSpecifiedBenchmarks();
+  benchmark::Shutdown();
+  return 0;
+}
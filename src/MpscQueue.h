@@ -0,0 +1,96 @@
+/**
+ * @file src/MpscQueue.h
+ * @brief Declarations for a bounded lock-free multi-producer queue
+ */
+#ifndef MPSCQUEUE_H
+#define MPSCQUEUE_H
+
+// standard includes
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <utility>
+
+/**
+ * @brief Fixed-capacity queue that any number of threads push to without locking.
+ *
+ * Every slot carries a sequence number telling producers and the consumer whose turn it is, so a
+ * push or pop is a single compare-and-swap on the shared position plus a store to the slot. Pops
+ * must all come from one thread at a time. Nothing is allocated after construction.
+ *
+ * @tparam T Element type, default constructible and move assignable.
+ * @tparam Capacity Number of slots, a power of two.
+ */
+template<typename T, std::size_t Capacity>
+class MpscQueue {
+  static_assert(Capacity >= 2 && (Capacity & (Capacity - 1)) == 0, "Capacity must be a power of two");
+
+public:
+  MpscQueue() {
+    for (std::size_t i = 0; i < Capacity; i++) {
+      slots[i].sequence.store(i, std::memory_order_relaxed);
+    }
+  }
+
+  MpscQueue(const MpscQueue &) = delete;
+  MpscQueue &operator=(const MpscQueue &) = delete;
+
+  /**
+   * @brief Append an element, safe to call from any thread
+   * @param value element to append, left untouched if the queue is full
+   * @return false if the queue is full
+   */
+  bool push(T &value) {
+    std::size_t position = enqueuePosition.load(std::memory_order_relaxed);
+    for (;;) {
+      Slot &slot = slots[position & (Capacity - 1)];
+      const std::size_t sequence = slot.sequence.load(std::memory_order_acquire);
+      const auto difference = static_cast<std::ptrdiff_t>(sequence) - static_cast<std::ptrdiff_t>(position);
+      if (difference == 0) {
+        if (enqueuePosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) {
+          slot.value = std::move(value);
+          slot.sequence.store(position + 1, std::memory_order_release);
+          return true;
+        }
+      } else if (difference < 0) {
+        // The consumer has not taken the element pushed one lap ago yet
+        return false;
+      } else {
+        position = enqueuePosition.load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  /**
+   * @brief Remove the oldest element, only from the consuming thread
+   * @param value set to the removed element
+   * @return false if the queue is empty
+   */
+  bool pop(T &value) {
+    const std::size_t position = dequeuePosition.load(std::memory_order_relaxed);
+    Slot &slot = slots[position & (Capacity - 1)];
+    if (slot.sequence.load(std::memory_order_acquire) != position + 1) {
+      // Empty, or a producer claimed the slot but did not finish writing it
+      return false;
+    }
+    dequeuePosition.store(position + 1, std::memory_order_relaxed);
+    value = std::move(slot.value);
+    slot.value = T();
+    slot.sequence.store(position + Capacity, std::memory_order_release);
+    return true;
+  }
+
+private:
+  /**
+   * @brief Element storage together with the position it is valid for
+   */
+  struct Slot {
+    std::atomic<std::size_t> sequence {0};  ///< Position + 1 once written, position + Capacity once read.
+    T value {};  ///< Stored element.
+  };
+
+  std::array<Slot, Capacity> slots;
+  alignas(64) std::atomic<std::size_t> enqueuePosition {0};
+  alignas(64) std::atomic<std::size_t> dequeuePosition {0};
+};
+#endif  // MPSCQUEUE_H
@@ -0,0 +1,397 @@
+/**
+ * @file src/QtIconCache.cpp
+ * @brief Qt tray icon cache implementation
+ */
+// standard includes
+#include <algorithm>
+#include <array>
+#include <cstring>
+
+// qt includes
+#include <QBuffer>
+#include <QCryptographicHash>
+#include <QDir>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QGuiApplication>
+#include <QImageReader>
+#include <QPainter>
+#include <QPixmap>
+#include <QSaveFile>
+#include <QSvgRenderer>
+
+// local includes
+#include "QtIconCache.h"
+
+namespace {
+  /**
+   * @brief Logical icon sizes tray hosts commonly ask for, up to the large ones some docks and menus show.
+   */
+  constexpr std::array<int, 8> TRAY_ICON_SIZES {16, 22, 24, 32, 48, 64, 128, 256};
+
+  constexpr char DISK_CACHE_MAGIC[8] = {'T', 'R', 'A', 'Y', 'P', 'I', 'X', '2'};
+  constexpr quint32 MAX_DISK_CACHE_IMAGES = 64;
+  constexpr int MAX_DISK_CACHE_FILES = 256;
+  constexpr int DISK_CACHE_MAX_AGE_DAYS = 30;
+
+  /**
+   * @brief Start of a disk cache file, followed by one DiskCacheImage per image and then the pixels of every image.
+   */
+  struct DiskCacheHeader {
+    char magic[8];  ///< DISK_CACHE_MAGIC, also versions the layout.
+    quint32 count;  ///< Number of images in the file.
+    quint32 reserved;  ///< Padding, always 0.
+  };
+
+  /**
+   * @brief Dimensions of one image in a disk cache file, whose pixels are stored as tightly packed premultiplied ARGB32.
+   */
+  struct DiskCacheImage {
+    quint32 width;  ///< Width in device pixels.
+    quint32 height;  ///< Height in device pixels.
+    quint32 ratioPercent;  ///< Device pixel ratio times 100.
+  };
+}  // namespace
+
+QtIconCache::QtIconCache(const std::size_t capacity):
+    capacity(std::max<std::size_t>(capacity, 1)) {
+}
+
+QIcon QtIconCache::find(const QString &path) {
+  // A single stat both validates a cached entry and rejects paths that are not files
+  const QFileInfo info(path);
+  if (!info.isFile()) {
+    return {};
+  }
+  const QDateTime modified = info.lastModified();
+  const qint64 size = info.size();
+  if (QIcon icon = cached(path, modified, size); !icon.isNull()) {
+    return icon;
+  }
+
+  missCount++;
+  QIcon icon = load(info);
+  if (!icon.isNull()) {
+    store(path, modified, size, icon);
+  }
+  return icon;
+}
+
+QIcon QtIconCache::peek(const QString &path, bool *isFile) {
+  const QFileInfo info(path);
+  *isFile = info.isFile();
+  if (!*isFile) {
+    return {};
+  }
+  return cached(path, info.lastModified(), info.size());
+}
+
+QtIconCache::Decoded QtIconCache::decode(const QString &path, const qreal ratio, const QString &diskCacheDirectory) {
+  Decoded decoded;
+  const QFileInfo info(path);
+  QFile file(path);
+  if (!info.isFile() || !file.open(QIODevice::ReadOnly)) {
+    return decoded;
+  }
+  decoded.path = path;
+  decoded.modified = info.lastModified();
+  decoded.size = info.size();
+  const QByteArray contents = file.readAll();
+
+  QString cachePath;
+  if (!diskCacheDirectory.isEmpty() && (isVectorIcon(info) || isMultiImageIcon(info))) {
+    cachePath = diskCachePath(diskCacheDirectory, contents, ratio);
+    decoded.images = readDiskCache(cachePath);
+    if (!decoded.images.empty()) {
+      decoded.diskCacheHit = true;
+      return decoded;
+    }
+  }
+  if (isVectorIcon(info)) {
+    QElapsedTimer timer;
+    timer.start();
+    decoded.images = renderSvg(contents, ratio);
+    decoded.svgRenderTime = timer.nsecsElapsed() / 1000;
+  } else {
+    decoded.images = decodeImages(contents);
+  }
+  if (!cachePath.isEmpty() && !decoded.images.empty()) {
+    decoded.diskCacheWrite = writeDiskCache(cachePath, decoded.images);
+  }
+  return decoded;
+}
+
+QIcon QtIconCache::insert(const Decoded &decoded) {
+  if (decoded.images.empty()) {
+    return {};
+  }
+  missCount++;
+  if (decoded.svgRenderTime >= 0) {
+    recordSvgRender(decoded.svgRenderTime);
+  }
+  diskCacheHitCount += decoded.diskCacheHit ? 1 : 0;
+  diskCacheWriteCount += decoded.diskCacheWrite ? 1 : 0;
+  const QIcon icon = iconFromImages(decoded.images);
+  if (const auto it = index.find(decoded.path); it != index.end()) {
+    entries.erase(it.value());
+    index.erase(it);
+  }
+  store(decoded.path, decoded.modified, decoded.size, icon);
+  return icon;
+}
+
+QIcon QtIconCache::cached(const QString &path, const QDateTime &modified, const qint64 size) {
+  const auto it = index.find(path);
+  if (it == index.end()) {
+    return {};
+  }
+  auto entry = it.value();
+  if (entry->modified == modified && entry->size == size) {
+    hitCount++;
+    entries.splice(entries.begin(), entries, entry);
+    return entry->icon;
+  }
+  // The file changed on disk since it was loaded
+  entries.erase(entry);
+  index.erase(it);
+  return {};
+}
+
+QIcon QtIconCache::load(const QFileInfo &info) {
+  const bool vector = isVectorIcon(info);
+  if (!vector && (!isMultiImageIcon(info) || diskCacheDirectory.isEmpty())) {
+    return QIcon(info.filePath());
+  }
+
+  QFile file(info.filePath());
+  if (!file.open(QIODevice::ReadOnly)) {
+    return {};
+  }
+  const QByteArray contents = file.readAll();
+  const qreal ratio = qGuiApp->devicePixelRatio();
+
+  QString cachePath;
+  if (!diskCacheDirectory.isEmpty()) {
+    cachePath = diskCachePath(diskCacheDirectory, contents, ratio);
+    if (const std::vector<QImage> cached = readDiskCache(cachePath); !cached.empty()) {
+      diskCacheHitCount++;
+      return iconFromImages(cached);
+    }
+  }
+
+  std::vector<QImage> images;
+  if (vector) {
+    QElapsedTimer timer;
+    timer.start();
+    images = renderSvg(contents, ratio);
+    if (!images.empty()) {
+      recordSvgRender(timer.nsecsElapsed() / 1000);
+    }
+  } else {
+    images = decodeImages(contents);
+  }
+  if (images.empty()) {
+    return QIcon(info.filePath());
+  }
+  if (!cachePath.isEmpty() && writeDiskCache(cachePath, images)) {
+    diskCacheWriteCount++;
+  }
+  return iconFromImages(images);
+}
+
+QIcon QtIconCache::iconFromImages(const std::vector<QImage> &images) {
+  QIcon icon;
+  for (const QImage &image : images) {
+    icon.addPixmap(QPixmap::fromImage(image));
+  }
+  return icon;
+}
+
+QString QtIconCache::diskCachePath(const QString &directory, const QByteArray &contents, const qreal ratio) {
+  // Keyed by content rather than path and modification time, so an edited file never matches a stale entry
+  const QString hash = QString::fromLatin1(QCryptographicHash::hash(contents, QCryptographicHash::Sha1).toHex());
+  return QStringLiteral("%1/%2-%3.pix").arg(directory, hash, QString::number(qRound(ratio * 100)));
+}
+
+void QtIconCache::recordSvgRender(const qint64 microseconds) {
+  svgRenderCount++;
+  svgRenderMicroseconds += static_cast<unsigned long long>(microseconds);
+}
+
+std::vector<QImage> QtIconCache::renderSvg(const QByteArray &contents, const qreal ratio) {
+  QSvgRenderer renderer(contents);
+  if (!renderer.isValid()) {
+    return {};
+  }
+
+  std::vector<QImage> images;
+  const QSizeF aspect = renderer.defaultSize().isEmpty() ? QSizeF(1, 1) : QSizeF(renderer.defaultSize());
+  for (const int size : TRAY_ICON_SIZES) {
+    const int extent = qRound(size * ratio);
+    QImage image(extent, extent, QImage::Format_ARGB32_Premultiplied);
+    image.fill(Qt::transparent);
+    // Keep the aspect ratio of the drawing and center it in the square
+    const QSizeF target = aspect.scaled(extent, extent, Qt::KeepAspectRatio);
+    QPainter painter(&image);
+    renderer.render(&painter, QRectF(QPointF((extent - target.width()) / 2, (extent - target.height()) / 2), target));
+    painter.end();
+    image.setDevicePixelRatio(ratio);
+    images.push_back(std::move(image));
+  }
+  return images;
+}
+
+std::vector<QImage> QtIconCache::decodeImages(const QByteArray &contents) {
+  QBuffer buffer;
+  buffer.setData(contents);
+  buffer.open(QIODevice::ReadOnly);
+  QImageReader reader(&buffer);
+  std::vector<QImage> images;
+  const int count = std::max(reader.imageCount(), 1);
+  for (int i = 0; i < count; i++) {
+    const QImage image = reader.read();
+    if (image.isNull()) {
+      break;
+    }
+    images.push_back(image.convertToFormat(QImage::Format_ARGB32_Premultiplied));
+  }
+  return images;
+}
+
+std::vector<QImage> QtIconCache::readDiskCache(const QString &path) {
+  QFile file(path);
+  if (!file.open(QIODevice::ReadOnly)) {
+    return {};
+  }
+  const qint64 fileSize = file.size();
+  if (fileSize < static_cast<qint64>(sizeof(DiskCacheHeader))) {
+    return {};
+  }
+  uchar *data = file.map(0, fileSize);
+  if (data == nullptr) {
+    return {};
+  }
+
+  std::vector<QImage> images;
+  DiskCacheHeader header {};
+  std::memcpy(&header, data, sizeof(header));
+  qint64 offset = static_cast<qint64>(sizeof(header) + header.count * sizeof(DiskCacheImage));
+  if (std::memcmp(header.magic, DISK_CACHE_MAGIC, sizeof(header.magic)) == 0 && header.count > 0 && header.count <= MAX_DISK_CACHE_IMAGES && offset <= fileSize) {
+    for (quint32 i = 0; i < header.count; i++) {
+      DiskCacheImage meta {};
+      std::memcpy(&meta, data + sizeof(header) + i * sizeof(DiskCacheImage), sizeof(meta));
+      const qint64 bytes = static_cast<qint64>(meta.width) * meta.height * 4;
+      if (meta.width == 0 || meta.height == 0 || offset + bytes > fileSize) {
+        images.clear();
+        break;
+      }
+      // Copy out of the mapping, which is gone once this function returns
+      QImage image = QImage(data + offset, static_cast<int>(meta.width), static_cast<int>(meta.height), static_cast<int>(meta.width * 4), QImage::Format_ARGB32_Premultiplied).copy();
+      image.setDevicePixelRatio(meta.ratioPercent / 100.0);
+      images.push_back(std::move(image));
+      offset += bytes;
+    }
+  }
+  file.unmap(data);
+  if (!images.empty()) {
+    // Best effort: a file in use counts as fresh when the directory is pruned
+    file.setFileTime(QDateTime::currentDateTime(), QFileDevice::FileModificationTime);
+  }
+  return images;
+}
+
+bool QtIconCache::writeDiskCache(const QString &path, const std::vector<QImage> &images) {
+  QSaveFile file(path);
+  if (!file.open(QIODevice::WriteOnly)) {
+    return false;
+  }
+  DiskCacheHeader header {};
+  std::memcpy(header.magic, DISK_CACHE_MAGIC, sizeof(header.magic));
+  header.count = static_cast<quint32>(images.size());
+  file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+  for (const QImage &image : images) {
+    const DiskCacheImage meta {static_cast<quint32>(image.width()), static_cast<quint32>(image.height()), static_cast<quint32>(qRound(image.devicePixelRatio() * 100))};
+    file.write(reinterpret_cast<const char *>(&meta), sizeof(meta));
+  }
+  for (const QImage &image : images) {
+    const QImage pixels = image.convertToFormat(QImage::Format_ARGB32_Premultiplied);
+    for (int y = 0; y < pixels.height(); y++) {
+      file.write(reinterpret_cast<const char *>(pixels.constScanLine(y)), static_cast<qint64>(pixels.width()) * 4);
+    }
+  }
+  if (!file.commit()) {
+    return false;
+  }
+  pruneDiskCache(QFileInfo(path).path());
+  return true;
+}
+
+void QtIconCache::pruneDiskCache(const QString &directory) {
+  // Newest first, so every file past the limit is one of the least recently used
+  const QFileInfoList files = QDir(directory).entryInfoList({QStringLiteral("*.pix")}, QDir::Files, QDir::Time);
+  const QDateTime cutoff = QDateTime::currentDateTime().addDays(-DISK_CACHE_MAX_AGE_DAYS);
+  for (int i = 0; i < files.size(); i++) {
+    if (i >= MAX_DISK_CACHE_FILES || files[i].lastModified() < cutoff) {
+      // Another process may be reading or removing the same file, so a failure is fine
+      QFile::remove(files[i].filePath());
+    }
+  }
+}
+
+void QtIconCache::reserve(const std::size_t count) {
+  capacity = std::max(capacity, count);
+}
+
+void QtIconCache::store(const QString &path, const QDateTime &modified, const qint64 size, const QIcon &icon) {
+  if (entries.size() >= capacity) {
+    index.remove(entries.back().path);
+    entries.pop_back();
+  }
+  entries.push_front({path, modified, size, icon});
+  index.insert(path, entries.begin());
+}
+
+void QtIconCache::setDiskCacheDirectory(const QString &directory) {
+  diskCacheDirectory = directory;
+}
+
+QString QtIconCache::diskCacheLocation() const {
+  return diskCacheDirectory;
+}
+
+void QtIconCache::clear() {
+  index.clear();
+  entries.clear();
+}
+
+unsigned long long QtIconCache::hits() const {
+  return hitCount;
+}
+
+unsigned long long QtIconCache::misses() const {
+  return missCount;
+}
+
+unsigned long long QtIconCache::svgRenders() const {
+  return svgRenderCount;
+}
+
+unsigned long long QtIconCache::svgRenderTime() const {
+  return svgRenderMicroseconds;
+}
+
+bool QtIconCache::isVectorIcon(const QFileInfo &info) {
+  return info.suffix().compare(QStringLiteral("svg"), Qt::CaseInsensitive) == 0 || info.suffix().compare(QStringLiteral("svgz"), Qt::CaseInsensitive) == 0;
+}
+
+bool QtIconCache::isMultiImageIcon(const QFileInfo &info) {
+  return info.suffix().compare(QStringLiteral("ico"), Qt::CaseInsensitive) == 0;
+}
+
+unsigned long long QtIconCache::diskCacheHits() const {
+  return diskCacheHitCount;
+}
+
+unsigned long long QtIconCache::diskCacheWrites() const {
+  return diskCacheWriteCount;
+}
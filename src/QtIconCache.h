@@ -0,0 +1,193 @@
+/**
+ * @file src/QtIconCache.h
+ * @brief Declarations for the Qt tray icon cache
+ */
+#ifndef QTICONCACHE_H
+#define QTICONCACHE_H
+
+// standard includes
+#include <cstddef>
+#include <list>
+#include <vector>
+
+// qt includes
+#include <QByteArray>
+#include <QDateTime>
+#include <QFileInfo>
+#include <QHash>
+#include <QIcon>
+#include <QImage>
+#include <QString>
+
+/**
+ * @brief Bounded cache of icons loaded from image files.
+ *
+ * Entries are keyed by file path and validated against the file's modification time and size,
+ * so a file that changed on disk is loaded again. The least recently used entry is evicted once
+ * the cache is full. SVG files are rendered once at the usual tray icon sizes, so showing them never
+ * goes through the SVG renderer again. With a disk cache directory, rendered SVG and decoded ICO
+ * files are also kept there as raw pixels keyed by file content and device pixel ratio, so a later
+ * process maps them instead of parsing the files.
+ *
+ * Files can also be decoded on any thread with decode() and handed to insert() on the GUI thread.
+ */
+class QtIconCache {
+public:
+  /**
+   * @brief Images decoded from an icon file, ready to be turned into an icon on the GUI thread
+   */
+  struct Decoded {
+    QString path;  ///< Path the images were decoded from, empty if it is not a readable file.
+    QDateTime modified;  ///< Modification time of the file when it was decoded.
+    qint64 size = 0;  ///< Size of the file when it was decoded.
+    std::vector<QImage> images;  ///< Decoded images, every size of an ICO or every rendered size of an SVG.
+    qint64 svgRenderTime = -1;  ///< Microseconds spent rendering an SVG file, -1 for other files and disk cache hits.
+    bool diskCacheHit = false;  ///< Whether the images were read from the disk cache instead of the file.
+    bool diskCacheWrite = false;  ///< Whether the images were written to the disk cache.
+  };
+
+  /**
+   * @brief Create an icon cache
+   * @param capacity maximum number of icons kept
+   */
+  explicit QtIconCache(std::size_t capacity = 32);
+
+  /**
+   * @brief Look up the icon of an image file, loading it on a miss
+   * @param path image file path
+   * @return the icon, or a null icon if the path is not a readable image file
+   */
+  QIcon find(const QString &path);
+
+  /**
+   * @brief Look up the icon of an image file without loading it on a miss
+   * @param path image file path
+   * @param isFile set to whether the path is a file
+   * @return the cached icon, or a null icon if the file is not cached or changed since
+   */
+  QIcon peek(const QString &path, bool *isFile);
+
+  /**
+   * @brief Decode an icon file, safe to call from any thread
+   * @param path image file path
+   * @param ratio device pixel ratio SVG files are rendered for
+   * @param diskCacheDirectory directory rasterized icons are read from and kept in, empty to always decode the file
+   * @return the decoded images
+   */
+  static Decoded decode(const QString &path, qreal ratio, const QString &diskCacheDirectory);
+
+  /**
+   * @brief Turn images decoded by decode() into an icon and cache it
+   * @param decoded decoded images
+   * @return the icon, or a null icon if nothing could be decoded
+   */
+  QIcon insert(const Decoded &decoded);
+
+  /**
+   * @brief Grow the cache so that it can hold at least the given number of icons
+   * @param count number of icons
+   */
+  void reserve(std::size_t count);
+
+  /**
+   * @brief Set the directory rasterized icons are kept in across processes
+   * @param directory existing directory, or an empty string to disable the disk cache
+   */
+  void setDiskCacheDirectory(const QString &directory);
+
+  /**
+   * @brief Directory rasterized icons are kept in, to hand to decode() on another thread
+   * @return the directory, or an empty string if the disk cache is disabled
+   */
+  QString diskCacheLocation() const;
+
+  /**
+   * @brief Drop all cached icons
+   */
+  void clear();
+
+  /**
+   * @brief Number of lookups answered from the cache
+   * @return hits since construction
+   */
+  unsigned long long hits() const;
+
+  /**
+   * @brief Number of lookups that had to load the file
+   * @return misses since construction
+   */
+  unsigned long long misses() const;
+
+  /**
+   * @brief Number of SVG files rendered into pixmaps
+   * @return renders since construction
+   */
+  unsigned long long svgRenders() const;
+
+  /**
+   * @brief Time spent rendering SVG files into pixmaps
+   * @return microseconds since construction
+   */
+  unsigned long long svgRenderTime() const;
+
+  /**
+   * @brief Number of icons loaded from the disk cache instead of their files
+   * @return disk cache hits since construction
+   */
+  unsigned long long diskCacheHits() const;
+
+  /**
+   * @brief Number of rasterized icons written to the disk cache
+   * @return disk cache writes since construction
+   */
+  unsigned long long diskCacheWrites() const;
+
+  /**
+   * @brief Check whether a file holds a vector icon that is rendered rather than decoded
+   * @param info file to check
+   * @return true for SVG files
+   */
+  static bool isVectorIcon(const QFileInfo &info);
+
+  /**
+   * @brief Check whether a file can hold several images of different sizes
+   * @param info file to check
+   * @return true for ICO files
+   */
+  static bool isMultiImageIcon(const QFileInfo &info);
+
+private:
+  QIcon cached(const QString &path, const QDateTime &modified, qint64 size);
+  QIcon load(const QFileInfo &info);
+  void recordSvgRender(qint64 microseconds);
+  static std::vector<QImage> renderSvg(const QByteArray &contents, qreal ratio);
+  static std::vector<QImage> decodeImages(const QByteArray &contents);
+  static QIcon iconFromImages(const std::vector<QImage> &images);
+  static QString diskCachePath(const QString &directory, const QByteArray &contents, qreal ratio);
+  static std::vector<QImage> readDiskCache(const QString &path);
+  static bool writeDiskCache(const QString &path, const std::vector<QImage> &images);
+  static void pruneDiskCache(const QString &directory);
+  void store(const QString &path, const QDateTime &modified, qint64 size, const QIcon &icon);
+
+  /**
+   * @brief Loaded icon together with the file state it was loaded from
+   */
+  struct Entry {
+    QString path;  ///< Path the icon was loaded from.
+    QDateTime modified;  ///< Modification time of the file when it was loaded.
+    qint64 size = 0;  ///< Size of the file when it was loaded.
+    QIcon icon;  ///< Loaded icon.
+  };
+
+  std::size_t capacity;
+  std::list<Entry> entries;  ///< Cached icons, most recently used first.
+  QHash<QString, std::list<Entry>::iterator> index;
+  unsigned long long hitCount = 0;
+  unsigned long long missCount = 0;
+  unsigned long long svgRenderCount = 0;
+  unsigned long long svgRenderMicroseconds = 0;
+  QString diskCacheDirectory;
+  unsigned long long diskCacheHitCount = 0;
+  unsigned long long diskCacheWriteCount = 0;
+};
+#endif  // QTICONCACHE_H
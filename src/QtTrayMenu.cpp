@@ -3,16 +3,33 @@
  * @brief Definitions for Qt tray menu implemenation
  */
 // standard includes
+#include <algorithm>
 #include <chrono>
-#include <filesystem>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <string_view>
 #include <thread>
+#include <vector>
 
 // qt includes
 #include <QApplication>
+#include <QBuffer>
+#include <QColor>
 #include <QCursor>
 #include <QDebug>
+#include <QFileInfo>
+#include <QFont>
+#include <QFontMetricsF>
+#include <QImage>
+#include <QImageReader>
 #include <QMouseEvent>
+#include <QPainter>
+#include <QPixmap>
+#include <QRegularExpression>
+#include <QRunnable>
 #include <QScreen>
+#include <QStringList>
 #include <QStyle>
 
 // local includes
@@ -27,6 +44,12 @@ namespace {
   constexpr int CURSOR_POSITION_POLL_INTERVAL_MS = 10;
   constexpr int CURSOR_POSITION_TIMEOUT_MS = 500;
   constexpr int CURSOR_POSITION_TOLERANCE = 2;
+  constexpr std::size_t MAX_POOLED_ACTIONS = 256;
+  constexpr std::size_t MAX_POOLED_MENUS = 32;
+  constexpr int DEFAULT_SOURCE_PAGE_SIZE = 50;
+  constexpr int MAX_ANIMATION_FPS = 60;
+  constexpr std::size_t MAX_BADGE_COMPOSITES = 16;
+  constexpr const char *SOURCE_MORE_TEXT = "More\xE2\x80\xA6";  // "More…" in UTF-8
 
   bool positionsAreClose(const QPoint &first, const QPoint &second) {
     return (first - second).manhattanLength() <= CURSOR_POSITION_TOLERANCE;
@@ -45,6 +68,147 @@ namespace {
     return targetGeometry.isValid() ? targetGeometry.contains(currentPosition) : positionsAreClose(currentPosition, targetPosition);
   }
 
+  std::size_t combineHash(const std::size_t seed, const std::size_t value) {
+    return seed ^ (value + 0x9e3779b97f4a7c15ULL + (seed << 6) + (seed >> 2));
+  }
+
+  /**
+   * @brief Hash one level of a menu: item identity, texts, flags, callbacks, contexts and submenu layout.
+   */
+  std::size_t menuFingerprint(const struct tray_menu *items) {
+    std::size_t hash = std::hash<const void *> {}(items);
+    while (items && items->text) {
+      hash = combineHash(hash, std::hash<std::string_view> {}(items->text));
+      hash = combineHash(hash, static_cast<std::size_t>((items->disabled << 2) | (items->checked << 1) | items->checkbox));
+      hash = combineHash(hash, reinterpret_cast<std::uintptr_t>(items->cb));
+      hash = combineHash(hash, std::hash<const void *> {}(items->context));
+      hash = combineHash(hash, std::hash<const void *> {}(items->submenu));
+      hash = combineHash(hash, std::hash<const void *> {}(items->source));
+      items++;
+    }
+    return hash;
+  }
+
+  /**
+   * @brief Number of menus above a menu, 0 for the top-level menu.
+   */
+  int menuDepth(const QWidget *menu) {
+    int depth = 0;
+    while ((menu = menu->parentWidget()) != nullptr) {
+      depth++;
+    }
+    return depth;
+  }
+
+  /**
+   * @brief Menu action that knows its slot in the tray menu dispatch table.
+   */
+  class TrayAction: public QAction {
+  public:
+    TrayAction(QObject *parent, const std::size_t slot):
+        QAction(parent),
+        slot(slot) {
+    }
+
+    const std::size_t slot;  ///< Index of the action in the dispatch table.
+  };
+
+  /**
+   * @brief Thread pool task running a function.
+   */
+  class FunctionTask: public QRunnable {
+  public:
+    explicit FunctionTask(std::function<void()> function):
+        function(std::move(function)) {
+    }
+
+    void run() override {
+      function();
+    }
+
+  private:
+    std::function<void()> function;
+  };
+
+  /**
+   * @brief Plain icon a size or scale variant such as icon@2x.png or icon-22.png belongs to.
+   */
+  struct IconVariant {
+    QString key;  ///< Path of the plain icon, e.g. icon.png for icon@2x.png.
+    qreal scale = 1;  ///< Device pixel ratio the file is drawn for.
+    int size = 0;  ///< Size in pixels named by a -N suffix, 0 without one.
+  };
+
+  IconVariant iconVariant(const QString &path) {
+    static const QRegularExpression pattern(QStringLiteral("^(.+?)(?:@(\\d+(?:\\.\\d+)?)x|-(\\d+))?(\\.[^.]+)$"));
+    const auto slash = path.lastIndexOf(QLatin1Char('/'));
+    const QString directory = path.left(slash + 1);
+    const QRegularExpressionMatch match = pattern.match(path.mid(slash + 1));
+    if (!match.hasMatch()) {
+      return {path, 1};
+    }
+    const QString scale = match.captured(2);
+    return {directory + match.captured(1) + match.captured(4), scale.isEmpty() ? 1 : scale.toDouble(), match.captured(3).toInt()};
+  }
+
+  /**
+   * @brief Path of the plain icon a decoded file is combined with, or its own path if it is no variant.
+   */
+  QString iconVariantGroup(const QtIconCache::Decoded &icon) {
+    const IconVariant variant = iconVariant(icon.path);
+    if (variant.size > 0 && std::none_of(icon.images.begin(), icon.images.end(), [&variant](const QImage &image) {
+          return image.width() == variant.size && image.height() == variant.size;
+        })) {
+      // A numbered file such as frame-1.png of an animation, not a 1 pixel variant of frame.png
+      return icon.path;
+    }
+    return variant.key;
+  }
+
+  /**
+   * @brief Build an icon from raw RGBA pixels or encoded image bytes held by the caller.
+   */
+  QIcon iconFromData(const struct tray_icon_data *data) {
+    // Qt 5 byte arrays and image rows are indexed by int, so larger buffers cannot be wrapped without truncation
+    if (data->data == nullptr || data->size > static_cast<std::size_t>(std::numeric_limits<int>::max())) {
+      return {};
+    }
+
+    QIcon icon;
+    if (data->width > 0 && data->height > 0) {
+      const qsizetype rowBytes = static_cast<qsizetype>(data->width) * 4;
+      const qsizetype stride = data->stride > 0 ? data->stride : rowBytes;
+      if (stride < rowBytes || stride > std::numeric_limits<int>::max() || (data->size > 0 && static_cast<qsizetype>(data->size) < stride * (data->height - 1) + rowBytes)) {
+        return {};
+      }
+      // Wrap the caller's pixels; converting them into the platform pixmap is the only copy
+      const QImage image(static_cast<const uchar *>(data->data), data->width, data->height, static_cast<int>(stride), QImage::Format_RGBA8888);
+      icon.addPixmap(QPixmap::fromImage(image));
+    } else {
+      if (data->size == 0) {
+        return {};
+      }
+      QBuffer buffer;
+      buffer.setData(QByteArray::fromRawData(static_cast<const char *>(data->data), static_cast<int>(data->size)));
+      buffer.open(QIODevice::ReadOnly);
+      QImageReader reader(&buffer);
+      const int count = std::max(reader.imageCount(), 1);
+      for (int i = 0; i < count; i++) {
+        const QImage image = reader.read();
+        if (image.isNull()) {
+          break;
+        }
+        icon.addPixmap(QPixmap::fromImage(image));
+      }
+    }
+    return icon;
+  }
+
+  std::size_t actionSlot(const QAction *action) {
+    // Every action in a tray menu is created by QtTrayMenu::createAction()
+    return static_cast<const TrayAction *>(action)->slot;
+  }
+
   bool fallbackTrayIconPosition(QPoint *position) {
     const QScreen *screen = QGuiApplication::primaryScreen();
     if (screen == nullptr) {
@@ -103,9 +267,20 @@ QtTrayMenu::QtTrayMenu(int argc, char **argv, QObject *parent, const bool debug)
   if (debug) {
     app->installEventFilter(this);
   }
+  connect(&animationTimer, &QTimer::timeout, this, &QtTrayMenu::onAnimationFrame);
 }
 
-QtTrayMenu::~QtTrayMenu() = default;
+QtTrayMenu::~QtTrayMenu() {
+  // Preload tasks post their results back to this object
+  iconLoader.waitForDone();
+  // Exiting the tray already joined the callback workers while serving the UI thread. This may run
+  // during static destruction, so only wait for anything left instead of processing events.
+  for (const auto &pool : callbackPools) {
+    pool->waitForDone();
+  }
+  callbackPools.clear();
+  clearPools();
+}
 
 int QtTrayMenu::init(struct tray *tray, const bool notification) {
   if (trayIcon) {
@@ -124,9 +299,22 @@ int QtTrayMenu::init(struct tray *tray, const bool notification) {
     QApplication::setApplicationName(tray->tooltip);
   }
 
+  preloadIcons(tray);
+
   // Create tray icon
-  trayIcon = std::make_unique<QSystemTrayIcon>(lookupIcon(tray->icon));
+  // With asynchronous decoding, a placeholder is shown until the icon is ready
+  baseIcon = asyncIconDecode ? QApplication::style()->standardIcon(QStyle::SP_ComputerIcon) : lookupIcon(tray->icon);
+  trayIcon = std::make_unique<QSystemTrayIcon>(baseIcon);
+  if (!badgeText.isEmpty()) {
+    showBaseIcon();
+  }
   trayIcon->setToolTip(QString::fromUtf8(tray->tooltip));
+  appliedIcon = tray->icon;
+  appliedIconKey = baseIcon.cacheKey();
+  appliedTooltip = tray->tooltip;
+  if (asyncIconDecode) {
+    requestIcon(tray->icon);
+  }
 
   connect(trayIcon.get(), &QSystemTrayIcon::activated, this, &QtTrayMenu::onTrayActivated);
   connect(trayIcon.get(), &QSystemTrayIcon::messageClicked, this, &QtTrayMenu::onMessageClicked);
@@ -137,7 +325,7 @@ int QtTrayMenu::init(struct tray *tray, const bool notification) {
   updateMenu(tray->menu);
 
   trayIcon->setContextMenu(trayTopMenu.get());
-  trayIcon->show();
+  setIconVisible(true);
 
   if (notification) {
     createNotification();
@@ -151,10 +339,24 @@ void QtTrayMenu::onUpdate(struct tray *tray, const bool notify) {
     return;
   }
   this->trayStruct = tray;
-  if (const auto newIcon = lookupIcon(trayStruct->icon); !newIcon.isNull()) {
-    trayIcon->setIcon(newIcon);
+  // The icon cache checks the file for changes, so a file rewritten in place resolves to a new icon
+  if (asyncIconDecode) {
+    requestIcon(trayStruct->icon);
+  } else if (const auto newIcon = lookupIcon(trayStruct->icon); qstrcmp(appliedIcon, trayStruct->icon) == 0 && newIcon.cacheKey() == appliedIconKey) {
+    trayStats.icon_updates_skipped++;
+  } else if (!newIcon.isNull()) {
+    applyIcon(newIcon);
+    appliedIcon = trayStruct->icon;
+    appliedIconKey = newIcon.cacheKey();
+    trayStats.icon_updates_applied++;
+  }
+  if (qstrcmp(appliedTooltip, trayStruct->tooltip) == 0) {
+    trayStats.tooltip_updates_skipped++;
+  } else {
+    trayIcon->setToolTip(QString::fromUtf8(trayStruct->tooltip));
+    appliedTooltip = trayStruct->tooltip;
+    trayStats.tooltip_updates_applied++;
   }
-  trayIcon->setToolTip(QString::fromUtf8(trayStruct->tooltip));
 
   updateMenu(trayStruct->menu);
   if (notify) {
@@ -184,6 +386,8 @@ int QtTrayMenu::loop(int blocking) {
 void QtTrayMenu::onExitRequested() {
   // Mark as no longer running
   running = false;
+  // Callbacks still running may read the items released below
+  stopCallbackPools();
   // Remove tray menu references
   if (trayTopMenu) {
     trayTopMenu->hide();
@@ -192,9 +396,24 @@ void QtTrayMenu::onExitRequested() {
     }
     trayTopMenu.reset();
   }
+  itemActions.clear();
+  menuStates.clear();
+  clearPools();
+  dispatchTable.clear();
+  freeSlots.clear();
+  appliedIcon.clear();
+  appliedIconKey = 0;
+  appliedTooltip.clear();
+  iconGeneration++;
+  variantIcons.clear();
+  animationTimer.stop();
+  animationFrames.clear();
+  badgeText.clear();
+  badgeComposites.clear();
+  baseIcon = QIcon();
   // Remove tray icon references;
   if (trayIcon) {
-    trayIcon->hide();
+    setIconVisible(false);
     trayIcon.reset();
   }
   // Unset tray structure
@@ -207,39 +426,301 @@ void QtTrayMenu::onExitRequested() {
 }
 
 void QtTrayMenu::updateMenu(struct tray_menu *items) {
-  // Create and setup new tray menu instance
-  auto newTrayTopMenu = std::make_unique<QMenu>();
+  if (!trayTopMenu) {
+    // Create and setup the tray menu instance once, later updates reconcile it in place
+    trayTopMenu = std::make_unique<QMenu>();
+    connect(trayTopMenu.get(), &QMenu::triggered, this, &QtTrayMenu::onMenuTriggered);
+    connect(trayTopMenu.get(), &QMenu::aboutToShow, this, &QtTrayMenu::onMenuAboutToShow);
 #if defined(_WIN32)
-  connect(newTrayTopMenu.get(), &QMenu::aboutToShow, this, []() {
-    tray_qt::windows::sync_color_scheme();
-  });
+    connect(trayTopMenu.get(), &QMenu::aboutToShow, this, []() {
+      tray_qt::windows::sync_color_scheme();
+    });
 #endif
-  trayIcon->setContextMenu(newTrayTopMenu.get());
-  // Fill new tray menu instance
-  createMenu(items, newTrayTopMenu.get());
-  trayTopMenu = std::move(newTrayTopMenu);
+  }
+
+  // Every built menu has to be checked against its items again before it is shown next
+  std::vector<QMenu *> visibleMenus;
+  for (auto &[menu, state] : menuStates) {
+    state.stale = true;
+    if (menu->isVisible()) {
+      visibleMenus.push_back(menu);
+    }
+  }
+  // Parents first, so every open submenu is rebound to its new items before it is materialized
+  std::sort(visibleMenus.begin(), visibleMenus.end(), [](const QMenu *first, const QMenu *second) {
+    return menuDepth(first) < menuDepth(second);
+  });
+  menuStates[trayTopMenu.get()].items = items;
+  materializeMenu(trayTopMenu.get());
+  for (QMenu *menu : visibleMenus) {
+    materializeMenu(menu);
+  }
+
+  if (trayIcon && trayIcon->contextMenu() != trayTopMenu.get()) {
+    trayIcon->setContextMenu(trayTopMenu.get());
+  }
 }
 
-void QtTrayMenu::createMenu(struct tray_menu *items, QMenu *menu) {
+void QtTrayMenu::reconcileMenu(struct tray_menu *items, QMenu *menu) {
+  // Walk the new items alongside the live actions, reusing every action whose kind still matches
+  QList<QAction *> existing = menu->actions();
+  qsizetype next = 0;
   while (items && items->text) {
-    if (strcmp(items->text, "-") == 0) {
-      menu->addSeparator();
-    } else {
-      auto *action = menu->addAction(QString::fromUtf8(items->text));
-      action->setDisabled(items->disabled == 1);
-      action->setCheckable(items->checkbox == 1);
-      action->setChecked(items->checked == 1);
-      action->setProperty("tray_menu_item", QVariant::fromValue((void *) items));
-      connect(action, &QAction::triggered, this, &QtTrayMenu::onMenuItemTriggered);
-      if (items->submenu) {
-        const auto submenu = new QMenu(menu);
-        createMenu(items->submenu, submenu);
-        action->setMenu(submenu);
+    const bool separator = strcmp(items->text, "-") == 0;
+    QAction *action = next < existing.size() ? existing.at(next) : nullptr;
+    if (!separator && items->id != 0 && action && dispatchTable[actionSlot(action)].id != items->id) {
+      // Pull the action that showed this id before into place, so it keeps its identity across reorders
+      for (qsizetype match = next + 1; match < existing.size(); match++) {
+        if (dispatchTable[actionSlot(existing.at(match))].id == items->id) {
+          QAction *moved = existing.takeAt(match);
+          menu->removeAction(moved);
+          menu->insertAction(action, moved);
+          existing.insert(next, moved);
+          action = moved;
+          break;
+        }
       }
-      menu->addAction(action);
+    }
+    if (action && action->isSeparator() == separator) {
+      next++;
+      trayStats.menu_actions_reused++;
+    } else {
+      action = createAction(menu, action, separator);
+    }
+    if (!separator) {
+      bindAction(action, items, menu);
     }
     items++;
   }
+  // Drop the actions left over from a longer previous menu
+  while (next < existing.size()) {
+    removeAction(existing.at(next++), menu);
+  }
+}
+
+QAction *QtTrayMenu::createAction(QMenu *menu, QAction *before, const bool separator) {
+  QAction *action;
+  if (!actionPool.empty()) {
+    // Pooled actions keep their dispatch slot, only ownership has to move to the new menu
+    action = actionPool.back();
+    actionPool.pop_back();
+    action->setParent(menu);
+    trayStats.menu_actions_recycled++;
+  } else {
+    std::size_t slot = dispatchTable.size();
+    if (!freeSlots.empty()) {
+      slot = freeSlots.back();
+      freeSlots.pop_back();
+    } else {
+      dispatchTable.emplace_back();
+    }
+    action = new TrayAction(menu, slot);
+    trayStats.menu_actions_created++;
+  }
+  dispatchTable[actionSlot(action)].menu = menu;
+  action->setSeparator(separator);
+  menu->insertAction(before, action);
+  return action;
+}
+
+QMenu *QtTrayMenu::createSubmenu(QMenu *parent) {
+  if (!menuPool.empty()) {
+    QMenu *submenu = menuPool.back();
+    menuPool.pop_back();
+    // QWidget::setParent() drops the window type unless the flags are passed along
+    submenu->setParent(parent, submenu->windowFlags());
+    trayStats.menus_recycled++;
+    return submenu;
+  }
+  auto *submenu = new QMenu(parent);
+  connect(submenu, &QMenu::triggered, this, &QtTrayMenu::onMenuTriggered);
+  connect(submenu, &QMenu::aboutToShow, this, &QtTrayMenu::onMenuAboutToShow);
+  trayStats.menus_created++;
+  return submenu;
+}
+
+void QtTrayMenu::recycleAction(QAction *action) {
+  if (QMenu *submenu = action->menu(); submenu != nullptr) {
+    action->setMenu(static_cast<QMenu *>(nullptr));
+    recycleMenu(submenu);
+  }
+  dispatchTable[actionSlot(action)] = {};
+  if (actionPool.size() >= MAX_POOLED_ACTIONS) {
+    // The action may be the sender of the callback that triggered this update
+    freeSlots.push_back(actionSlot(action));
+    action->deleteLater();
+    return;
+  }
+  action->setText(QString());
+  action->setChecked(false);
+  action->setCheckable(false);
+  action->setEnabled(true);
+  action->setParent(this);
+  actionPool.push_back(action);
+}
+
+void QtTrayMenu::recycleMenu(QMenu *menu) {
+  menu->hide();
+  menuStates.erase(menu);
+  for (QAction *child : menu->actions()) {
+    menu->removeAction(child);
+    recycleAction(child);
+  }
+  if (menuPool.size() >= MAX_POOLED_MENUS) {
+    menu->deleteLater();
+    return;
+  }
+  menu->setParent(nullptr, menu->windowFlags());
+  menuPool.push_back(menu);
+}
+
+void QtTrayMenu::clearPools() {
+  qDeleteAll(actionPool);
+  actionPool.clear();
+  qDeleteAll(menuPool);
+  menuPool.clear();
+}
+
+void QtTrayMenu::bindAction(QAction *action, struct tray_menu *item, QMenu *menu) {
+  applyItemState(action, item);
+  auto &entry = dispatchTable[actionSlot(action)];
+  if (entry.item != item) {
+    unindexAction(action, entry.item);
+    entry.item = item;
+  }
+  entry.menu = menu;
+  entry.id = item->id;
+  itemActions[item] = action;
+
+  QMenu *submenu = action->menu();
+  if (item->submenu || item->source) {
+    if (!submenu) {
+      submenu = createSubmenu(menu);
+      action->setMenu(submenu);
+    }
+    // The "More…" entry of a source page continues the parent's source where the page ended
+    int offset = 0;
+    if (const auto parent = menuStates.find(menu); parent != menuStates.end() && parent->second.moreItem == item) {
+      offset = parent->second.offset + static_cast<int>(parent->second.page.size()) - 2;
+    }
+    // Submenus are only (re)built once they are about to be shown
+    auto &state = menuStates[submenu];
+    state.parentItem = item;
+    state.items = item->submenu;
+    state.source = item->source;
+    state.offset = offset;
+    state.stale = true;
+    if (submenu->isVisible()) {
+      materializeMenu(submenu);
+    }
+  } else if (submenu) {
+    releaseSubmenu(action);
+  }
+}
+
+void QtTrayMenu::materializeMenu(QMenu *menu) {
+  const auto it = menuStates.find(menu);
+  if (it == menuStates.end() || !it->second.stale) {
+    return;
+  }
+  auto &state = it->second;
+  state.stale = false;
+  struct tray_menu *items = state.source ? fetchSourcePage(state) : state.items;
+  const std::size_t fingerprint = menuFingerprint(items);
+  if (state.built && state.fingerprint == fingerprint) {
+    trayStats.menus_skipped++;
+    return;
+  }
+  state.built = true;
+  state.fingerprint = fingerprint;
+  trayStats.menus_materialized++;
+  reconcileMenu(items, menu);
+}
+
+struct tray_menu *QtTrayMenu::fetchSourcePage(MenuState &state) {
+  struct tray_menu_source *source = state.source;
+  const int total = source->count ? std::max(source->count(source), 0) : 0;
+  const int pageSize = source->page_size > 0 ? source->page_size : DEFAULT_SOURCE_PAGE_SIZE;
+  const int first = std::min(state.offset, total);
+  const int last = std::min(first + pageSize, total);
+
+  // Refill the page in place so its address, and thereby its fingerprint, stays stable between fetches
+  state.page.reserve(static_cast<std::size_t>(pageSize) + 2);
+  state.page.assign(static_cast<std::size_t>(last - first), tray_menu {});
+  for (int index = first; index < last; index++) {
+    struct tray_menu &item = state.page[index - first];
+    if (source->get_item) {
+      source->get_item(source, index, &item);
+    }
+    if (item.text == nullptr) {
+      item.text = "";
+    }
+  }
+  state.moreItem = nullptr;
+  if (last < total) {
+    struct tray_menu &more = state.page.emplace_back();
+    more.text = SOURCE_MORE_TEXT;
+    more.source = source;
+  }
+  state.page.push_back(tray_menu {});
+  if (last < total) {
+    state.moreItem = &state.page[state.page.size() - 2];
+  }
+  return state.page.data();
+}
+
+void QtTrayMenu::releaseSubmenu(QAction *action) {
+  QMenu *submenu = action->menu();
+  for (const QAction *child : submenu->actions()) {
+    unindexAction(child, getTrayMenuItem(child));
+  }
+  action->setMenu(static_cast<QMenu *>(nullptr));
+  recycleMenu(submenu);
+}
+
+void QtTrayMenu::removeAction(QAction *action, QMenu *menu) {
+  menu->removeAction(action);
+  unindexAction(action, getTrayMenuItem(action));
+  recycleAction(action);
+}
+
+void QtTrayMenu::applyItemState(QAction *action, const struct tray_menu *item) const {
+  action->setText(QString::fromUtf8(item->text));
+  action->setDisabled(item->disabled == 1);
+  action->setCheckable(item->checkbox == 1);
+  action->setChecked(item->checked == 1);
+}
+
+void QtTrayMenu::unindexAction(const QAction *action, const struct tray_menu *item) {
+  if (item == nullptr) {
+    return;
+  }
+  if (const auto it = itemActions.find(item); it != itemActions.end() && it->second == action) {
+    itemActions.erase(it);
+  }
+  if (const QMenu *submenu = action->menu(); submenu != nullptr) {
+    for (const QAction *child : submenu->actions()) {
+      unindexAction(child, getTrayMenuItem(child));
+    }
+    menuStates.erase(submenu);
+  }
+}
+
+bool QtTrayMenu::updateMenuItem(const struct tray_menu *item) {
+  const auto it = itemActions.find(item);
+  if (it == itemActions.end()) {
+    return false;
+  }
+  applyItemState(it->second, item);
+  // The action no longer matches the fingerprint of its level, so the next update must reconcile it
+  invalidateMenu(dispatchTable[actionSlot(it->second)].menu);
+  return true;
+}
+
+void QtTrayMenu::invalidateMenu(const QMenu *menu) {
+  if (const auto it = menuStates.find(const_cast<QMenu *>(menu)); it != menuStates.end()) {
+    it->second.built = false;
+  }
 }
 
 void QtTrayMenu::createNotification() {
@@ -254,19 +735,407 @@ void QtTrayMenu::createNotification() {
   }
 }
 
-QIcon QtTrayMenu::lookupIcon(QString icon) const {
+void QtTrayMenu::preloadIcons(const struct tray *tray) {
+  QStringList paths;
+  for (int i = 0; i < tray->iconPathCount; i++) {
+    if (tray->allIconPaths[i] != nullptr) {
+      paths.append(QString::fromUtf8(tray->allIconPaths[i]));
+    }
+  }
+  if (paths.isEmpty()) {
+    return;
+  }
+  iconCache.reserve(static_cast<std::size_t>(paths.size()));
+  const qreal ratio = qGuiApp->devicePixelRatio();
+  const QString diskCache = iconCache.diskCacheLocation();
+
+  if (!asyncIconPreload) {
+    std::vector<QtIconCache::Decoded> decoded;
+    for (const QString &path : paths) {
+      decoded.push_back(QtIconCache::decode(path, ratio, diskCache));
+    }
+    storePreloadedIcons(decoded);
+    return;
+  }
+
+  iconLoader.start(new FunctionTask([this, paths, ratio, diskCache]() {
+    std::vector<QtIconCache::Decoded> decoded;
+    for (const QString &path : paths) {
+      decoded.push_back(QtIconCache::decode(path, ratio, diskCache));
+    }
+    // Pixmaps can only be created on the GUI thread
+    QMetaObject::invokeMethod(
+      this,
+      [this, decoded = std::move(decoded)]() {
+        storePreloadedIcons(decoded);
+      },
+      Qt::QueuedConnection
+    );
+  }));
+}
+
+void QtTrayMenu::storePreloadedIcons(const std::vector<QtIconCache::Decoded> &decoded) {
+  // Every file is decoded once; the cache and the combined variants share the images
+  for (const auto &icon : decoded) {
+    if (!iconCache.insert(icon).isNull()) {
+      trayStats.icons_preloaded++;
+    }
+  }
+  combineIconVariants(decoded);
+  syncIconCacheStats();
+}
+
+void QtTrayMenu::combineIconVariants(const std::vector<QtIconCache::Decoded> &decoded) {
+  QHash<QString, std::vector<const QtIconCache::Decoded *>> groups;
+  for (const auto &icon : decoded) {
+    if (!icon.images.empty()) {
+      groups[iconVariantGroup(icon)].push_back(&icon);
+    }
+  }
+  for (auto group = groups.cbegin(); group != groups.cend(); ++group) {
+    if (group.value().size() < 2) {
+      continue;
+    }
+    // One icon holding every variant, so the platform picks the matching pixmap instead of scaling one
+    VariantIcon combined;
+    for (const auto *icon : group.value()) {
+      combined.members.push_back({icon->path, icon->modified, icon->size});
+      const qreal scale = iconVariant(icon->path).scale;
+      for (QImage image : icon->images) {
+        if (!QtIconCache::isVectorIcon(QFileInfo(icon->path))) {
+          // Rendered SVG images already carry the screen's ratio, also when read back from the disk cache
+          image.setDevicePixelRatio(scale);
+        }
+        combined.icon.addPixmap(QPixmap::fromImage(image));
+      }
+    }
+    variantIcons.insert(group.key(), combined);
+    trayStats.icon_variants_combined += group.value().size();
+  }
+}
+
+QIcon QtTrayMenu::variantIcon(const QString &path, QStringList *changed) {
+  const auto variants = variantIcons.constFind(path);
+  if (variants == variantIcons.constEnd()) {
+    return {};
+  }
+  for (const auto &member : variants->members) {
+    if (const QFileInfo info(member.path); !info.isFile() || info.lastModified() != member.modified || info.size() != member.size) {
+      // One edited or removed file invalidates the whole group, which is combined again from the current files
+      for (const auto &stale : variants->members) {
+        changed->append(stale.path);
+      }
+      variantIcons.erase(variants);
+      return {};
+    }
+  }
+  return variants->icon;
+}
+
+QIcon QtTrayMenu::storeDecodedIcons(const QString &path, const std::vector<QtIconCache::Decoded> &decoded) {
+  QIcon icon;
+  for (const auto &file : decoded) {
+    if (const QIcon inserted = iconCache.insert(file); file.path == path) {
+      icon = inserted;
+    }
+  }
+  combineIconVariants(decoded);
+  syncIconCacheStats();
+  const auto variants = variantIcons.constFind(path);
+  return variants != variantIcons.constEnd() ? variants->icon : icon;
+}
+
+void QtTrayMenu::requestIcon(const char *name) {
+  const QString path = QString::fromUtf8(name);
+  bool isFile = false;
+  QStringList changed;
+  QIcon cached = variantIcon(path, &changed);
+  if (cached.isNull() && changed.isEmpty()) {
+    cached = iconCache.peek(path, &isFile);
+    syncIconCacheStats();
+  }
+  if (!cached.isNull() || (!isFile && changed.isEmpty())) {
+    // Combined variants, cached files and theme names resolve without touching the disk
+    const QIcon icon = cached.isNull() ? lookupIcon(path) : cached;
+    if (qstrcmp(appliedIcon, name) == 0 && icon.cacheKey() == appliedIconKey) {
+      trayStats.icon_updates_skipped++;
+      return;
+    }
+    appliedIcon = name;
+    appliedIconKey = icon.cacheKey();
+    iconGeneration++;
+    applyIcon(icon);
+    trayStats.icon_updates_applied++;
+    return;
+  }
+
+  appliedIcon = name;
+  const quint64 generation = ++iconGeneration;
+
+  // Keep showing the current icon until the new one is decoded
+  const qreal ratio = qGuiApp->devicePixelRatio();
+  const QString diskCache = iconCache.diskCacheLocation();
+  // A changed variant group is decoded as a whole, so it is combined again
+  const QStringList files = changed.isEmpty() ? QStringList {path} : changed;
+  iconLoader.start(new FunctionTask([this, path, files, ratio, diskCache, generation]() {
+    std::vector<QtIconCache::Decoded> decoded;
+    for (const QString &file : files) {
+      decoded.push_back(QtIconCache::decode(file, ratio, diskCache));
+    }
+    QMetaObject::invokeMethod(
+      this,
+      [this, path, generation, decoded = std::move(decoded)]() {
+        QIcon icon = storeDecodedIcons(path, decoded);
+        if (generation != iconGeneration || !trayIcon) {
+          // Another icon was requested or applied in the meantime
+          return;
+        }
+        if (icon.isNull()) {
+          icon = lookupIcon(path);
+        } else {
+          trayStats.icons_decoded_async++;
+        }
+        appliedIconKey = icon.cacheKey();
+        applyIcon(icon);
+        trayStats.icon_updates_applied++;
+      },
+      Qt::QueuedConnection
+    );
+  }));
+}
+
+QIcon QtTrayMenu::lookupIcon(const QString &icon) {
   // Find icon for tray
-  if (std::filesystem::exists(icon.toStdString())) {
-    if (auto result = QIcon(icon); !result.isNull()) {
-      return result;
+  QStringList changed;
+  if (const QIcon variants = variantIcon(icon, &changed); !variants.isNull()) {
+    return variants;
+  }
+  if (!changed.isEmpty()) {
+    const qreal ratio = qGuiApp->devicePixelRatio();
+    const QString diskCache = iconCache.diskCacheLocation();
+    std::vector<QtIconCache::Decoded> decoded;
+    for (const QString &file : changed) {
+      decoded.push_back(QtIconCache::decode(file, ratio, diskCache));
+    }
+    if (const QIcon rebuilt = storeDecodedIcons(icon, decoded); !rebuilt.isNull()) {
+      return rebuilt;
     }
   }
-  if (auto result = QIcon::fromTheme(icon); !result.isNull()) {
+  auto result = iconCache.find(icon);
+  syncIconCacheStats();
+  if (!result.isNull()) {
     return result;
   }
+  if (const QString theme = QIcon::themeName() + QLatin1Char('\n') + QIcon::fallbackThemeName(); theme != themeIconsTheme) {
+    // Lookups made against another icon theme say nothing about the current one
+    themeIcons.clear();
+    themeIconsTheme = theme;
+  }
+  auto themed = themeIcons.constFind(icon);
+  if (themed != themeIcons.constEnd()) {
+    trayStats.theme_icon_hits++;
+  } else {
+    // Names that do not resolve are remembered as null icons, so they do not walk the theme directories again
+    themed = themeIcons.insert(icon, QIcon::fromTheme(icon));
+    trayStats.theme_icon_misses++;
+  }
+  if (!themed->isNull()) {
+    return *themed;
+  }
   return QApplication::style()->standardIcon(QStyle::SP_ComputerIcon);
 }
 
+QIcon QtTrayMenu::icon() const {
+  return trayIcon ? baseIcon : QIcon();
+}
+
+void QtTrayMenu::applyIcon(const QIcon &icon) {
+  baseIcon = icon;
+  showBaseIcon();
+}
+
+void QtTrayMenu::showBaseIcon() {
+  if (!animationFrames.empty()) {
+    // A running animation keeps showing its frames, the base icon returns once it stops
+    return;
+  }
+  trayIcon->setIcon(badgeText.isEmpty() ? baseIcon : badgedIcon());
+}
+
+void QtTrayMenu::setBadge(const QString &text) {
+  if (text == badgeText) {
+    return;
+  }
+  badgeText = text;
+  if (trayIcon) {
+    showBaseIcon();
+  }
+}
+
+QIcon QtTrayMenu::badgedIcon() {
+  const int extent = trayIconExtent();
+  const qint64 baseKey = baseIcon.cacheKey();
+  for (auto it = badgeComposites.begin(); it != badgeComposites.end(); ++it) {
+    if (it->baseKey == baseKey && it->extent == extent && it->text == badgeText) {
+      std::rotate(badgeComposites.begin(), it, it + 1);
+      trayStats.badge_composites_reused++;
+      return badgeComposites.front().icon;
+    }
+  }
+
+  const qreal ratio = qGuiApp->devicePixelRatio();
+  QImage image(qRound(extent * ratio), qRound(extent * ratio), QImage::Format_ARGB32_Premultiplied);
+  image.fill(Qt::transparent);
+  image.setDevicePixelRatio(ratio);
+  QPainter painter(&image);
+  painter.setRenderHint(QPainter::Antialiasing);
+  baseIcon.paint(&painter, QRect(0, 0, extent, extent));
+
+  // Pill in the bottom right corner, just over half the icon high and as wide as the text needs
+  const qreal diameter = extent * 0.6;
+  QFont font = painter.font();
+  font.setBold(true);
+  font.setPixelSize(std::max(1, qRound(diameter * 0.7)));
+  const qreal width = std::min<qreal>(extent, std::max(diameter, QFontMetricsF(font).horizontalAdvance(badgeText) + diameter * 0.4));
+  const QRectF badge(extent - width, extent - diameter, width, diameter);
+  painter.setPen(Qt::NoPen);
+  painter.setBrush(QColor(0xD3, 0x2F, 0x2F));
+  painter.drawRoundedRect(badge, diameter / 2, diameter / 2);
+  painter.setPen(Qt::white);
+  painter.setFont(font);
+  painter.drawText(badge, Qt::AlignCenter, badgeText);
+  painter.end();
+
+  if (badgeComposites.size() >= MAX_BADGE_COMPOSITES) {
+    badgeComposites.pop_back();
+  }
+  badgeComposites.insert(badgeComposites.begin(), {baseKey, extent, badgeText, QIcon(QPixmap::fromImage(image))});
+  trayStats.badge_composites_rendered++;
+  return badgeComposites.front().icon;
+}
+
+int QtTrayMenu::trayIconExtent() const {
+  const QRect geometry = trayIcon->geometry();
+  return geometry.isValid() ? std::min(geometry.width(), geometry.height()) : QApplication::style()->pixelMetric(QStyle::PM_SmallIconSize);
+}
+
+int QtTrayMenu::setIconData(const struct tray_icon_data *data) {
+  if (!trayIcon) {
+    return -1;
+  }
+  if (data == nullptr) {
+    const QIcon icon = lookupIcon(trayStruct->icon);
+    applyIcon(icon);
+    appliedIcon = trayStruct->icon;
+    appliedIconKey = icon.cacheKey();
+    iconGeneration++;
+    return 0;
+  }
+  const QIcon icon = iconFromData(data);
+  if (icon.isNull()) {
+    return -1;
+  }
+  iconGeneration++;
+
+  applyIcon(icon);
+  trayStats.icon_data_updates++;
+  return 0;
+}
+
+int QtTrayMenu::startIconAnimation(const char *const *paths, const int count, const int fps) {
+  if (!trayIcon || paths == nullptr || count <= 0) {
+    return -1;
+  }
+  std::vector<QIcon> icons;
+  icons.reserve(static_cast<std::size_t>(count));
+  for (int i = 0; i < count; i++) {
+    icons.push_back(lookupIcon(QString::fromUtf8(paths[i])));
+  }
+  return runIconAnimation(icons, fps);
+}
+
+int QtTrayMenu::startIconAnimation(const struct tray_icon_data *frames, const int count, const int fps) {
+  if (!trayIcon || frames == nullptr || count <= 0) {
+    return -1;
+  }
+  std::vector<QIcon> icons;
+  icons.reserve(static_cast<std::size_t>(count));
+  for (int i = 0; i < count; i++) {
+    const QIcon icon = iconFromData(&frames[i]);
+    if (icon.isNull()) {
+      return -1;
+    }
+    icons.push_back(icon);
+  }
+  return runIconAnimation(icons, fps);
+}
+
+int QtTrayMenu::runIconAnimation(const std::vector<QIcon> &icons, const int fps) {
+  if (fps <= 0) {
+    return -1;
+  }
+
+  // Rasterize every frame once at the tray icon size, so a frame switch is only a pixmap swap
+  const int extent = trayIconExtent();
+  animationFrames.clear();
+  animationFrames.reserve(icons.size());
+  for (const QIcon &icon : icons) {
+    animationFrames.emplace_back(icon.pixmap(QSize(extent, extent)));
+  }
+  animationFrame = 0;
+  trayIcon->setIcon(animationFrames.front());
+  trayStats.animation_frames_shown++;
+  animationTimer.setInterval(1000 / std::min(fps, MAX_ANIMATION_FPS));
+  if (trayIcon->isVisible()) {
+    animationTimer.start();
+  }
+  return 0;
+}
+
+void QtTrayMenu::stopIconAnimation() {
+  if (animationFrames.empty()) {
+    return;
+  }
+  animationTimer.stop();
+  animationFrames.clear();
+  if (trayIcon) {
+    showBaseIcon();
+  }
+}
+
+void QtTrayMenu::onAnimationFrame() {
+  if (!trayIcon || animationFrames.empty()) {
+    animationTimer.stop();
+    return;
+  }
+  if (!trayIcon->isVisible()) {
+    // Nothing to draw into while the icon is hidden; setIconVisible() resumes the animation
+    animationTimer.stop();
+    return;
+  }
+  animationFrame = (animationFrame + 1) % animationFrames.size();
+  trayIcon->setIcon(animationFrames[animationFrame]);
+  trayStats.animation_frames_shown++;
+}
+
+void QtTrayMenu::setIconVisible(const bool visible) {
+  trayIcon->setVisible(visible);
+  if (!visible) {
+    animationTimer.stop();
+  } else if (!animationFrames.empty() && !animationTimer.isActive()) {
+    animationTimer.start();
+  }
+}
+
+void QtTrayMenu::syncIconCacheStats() {
+  trayStats.icon_cache_hits = iconCache.hits();
+  trayStats.icon_cache_misses = iconCache.misses();
+  trayStats.svg_renders = iconCache.svgRenders();
+  trayStats.svg_render_time_us = iconCache.svgRenderTime();
+  trayStats.icon_disk_cache_hits = iconCache.diskCacheHits();
+  trayStats.icon_disk_cache_writes = iconCache.diskCacheWrites();
+}
+
 bool QtTrayMenu::eventFilter(QObject *watched, QEvent *event) {
   qDebug() << "Event Type:" << event->type();
   return QObject::eventFilter(watched, event);
@@ -277,33 +1146,135 @@ void QtTrayMenu::onTrayActivated(QSystemTrayIcon::ActivationReason reason) {
     return;
   }
   if (trayStruct && trayStruct->cb) {
-    trayStruct->cb(trayStruct);
+    struct tray *tray = trayStruct;
+    runCallback(tray, [tray]() {
+      tray->cb(tray);
+    });
   } else {
     showMenu();
   }
 }
 
-void QtTrayMenu::onMenuItemTriggered() {
-  const auto *action = qobject_cast<const QAction *>(sender());
-  struct tray_menu *menuItem = getTrayMenuItem(action);
+void QtTrayMenu::onMenuAboutToShow() {
+  auto *menu = qobject_cast<QMenu *>(sender());
+  if (const auto it = menuStates.find(menu); it == menuStates.end() || it->second.source) {
+    if (it != menuStates.end()) {
+      // Ask the source again on every show; the fingerprint still skips the rebuild when nothing changed
+      it->second.stale = true;
+    }
+    materializeMenu(menu);
+    return;
+  }
+  if (menuProvider && trayStruct) {
+    struct tray_menu *parent = menuStates[menu].parentItem;
+    trayStats.menu_provider_calls++;
+    menuProvider(trayStruct, parent);
+    // The provider may have exited the tray or replaced the items, so look everything up again
+    const auto it = menuStates.find(menu);
+    if (!trayStruct || it == menuStates.end()) {
+      return;
+    }
+    it->second.items = parent ? parent->submenu : trayStruct->menu;
+    it->second.stale = true;
+  }
+  materializeMenu(menu);
+}
+
+void QtTrayMenu::setMenuProvider(void (*provider)(struct tray *, struct tray_menu *)) {
+  menuProvider = provider;
+}
+
+void QtTrayMenu::setAsyncIconPreload(const bool async) {
+  asyncIconPreload = async;
+}
+
+void QtTrayMenu::setAsyncIconDecode(const bool async) {
+  asyncIconDecode = async;
+}
+
+void QtTrayMenu::setIconDiskCache(const QString &directory) {
+  iconCache.setDiskCacheDirectory(directory);
+}
+
+void QtTrayMenu::onMenuTriggered(QAction *action) {
+  // Parent menus re-emit triggered() for the actions of their submenus, only dispatch from the owning menu
+  const auto &entry = dispatchTable[actionSlot(action)];
+  if (entry.menu != sender()) {
+    return;
+  }
+  if (action->isCheckable()) {
+    // Qt toggled the check mark on its own, which the fingerprint of the level knows nothing about
+    invalidateMenu(entry.menu);
+  }
+  struct tray_menu *menuItem = entry.item;
+  if (!menuItem || !menuItem->cb) {
+    return;
+  }
+  if (const auto state = menuStates.find(const_cast<QMenu *>(entry.menu)); state != menuStates.end() && state->second.source) {
+    // Source pages are refilled on every fetch, so the callback gets a copy of the item it was triggered for
+    runCallback(menuItem, [item = *menuItem]() mutable {
+      item.cb(&item);
+    });
+    return;
+  }
+  runCallback(menuItem, [menuItem, cb = menuItem->cb]() {
+    cb(menuItem);
+  });
+}
+
+void QtTrayMenu::setCallbackThreads(const int count) {
+  stopCallbackPools();
+  for (int i = 0; i < count; i++) {
+    auto pool = std::make_unique<QThreadPool>();
+    // One thread per pool keeps the callbacks of an item in the order they were triggered
+    pool->setMaxThreadCount(1);
+    callbackPools.push_back(std::move(pool));
+  }
+}
+
+void QtTrayMenu::setItemOwner(std::shared_ptr<const void> owner) {
+  itemOwner = std::move(owner);
+}
 
-  if (menuItem && menuItem->cb) {
-    menuItem->cb(menuItem);
+void QtTrayMenu::runCallback(const void *key, std::function<void()> callback) {
+  if (callbackPools.empty()) {
+    callback();
+    return;
+  }
+  trayStats.callbacks_offloaded++;
+  // Neighbouring items of a menu array differ in only a few middle bits of their addresses, so mix
+  // every bit into the high half with a Fibonacci multiply before picking a pool
+  const std::uint64_t hash = static_cast<std::uint64_t>(reinterpret_cast<std::uintptr_t>(key)) * 0x9E3779B97F4A7C15ULL;
+  const auto shard = static_cast<std::size_t>(hash >> 32) % callbackPools.size();
+  callbackPools[shard]->start(new FunctionTask([callback = std::move(callback), owner = itemOwner]() {
+    callback();
+  }));
+}
+
+void QtTrayMenu::stopCallbackPools() {
+  // Taken out first, so a nested exit while events are served below finds nothing left to stop
+  const auto pools = std::move(callbackPools);
+  callbackPools.clear();
+  for (const auto &pool : pools) {
+    // A callback may be waiting for this thread, e.g. in tray_update(), so keep serving it meanwhile
+    while (!pool->waitForDone(10)) {
+      QCoreApplication::processEvents();
+    }
   }
 }
 
-struct tray_menu *QtTrayMenu::getTrayMenuItem(const QAction *action) {
-  return static_cast<struct tray_menu *>(action->property("tray_menu_item").value<void *>());
+struct tray_menu *QtTrayMenu::getTrayMenuItem(const QAction *action) const {
+  return dispatchTable[actionSlot(action)].item;
 }
 
-void QtTrayMenu::onMessageClicked() const {
+void QtTrayMenu::onMessageClicked() {
   if (notificationCallback == nullptr) {
     return;
   }
 
   auto callback = std::move(notificationCallback);
   notificationCallback = nullptr;
-  callback();
+  runCallback(&notificationCallback, std::move(callback));
 }
 
 void QtTrayMenu::configureAppMetadata(const QString &appName, const QString &appDisplayName, const QString &desktopName) const {
@@ -347,6 +1318,14 @@ void QtTrayMenu::onShowMenu() const {
   }
 }
 
+QMenu *QtTrayMenu::contextMenu() const {
+  return trayTopMenu.get();
+}
+
+const struct tray_stats &QtTrayMenu::stats() const {
+  return trayStats;
+}
+
 bool QtTrayMenu::supportsMessages() {
   return QSystemTrayIcon::supportsMessages();
 }
@@ -390,6 +1369,23 @@ void QtTrayMenu::clickMenuItem(int index) const {
   emit action->trigger();
 }
 
+void QtTrayMenu::openSubmenu(int index) const {
+  if (!trayIcon) {
+    return;
+  }
+  const QMenu *menu = trayIcon->contextMenu();
+  if (!menu) {
+    return;
+  }
+  const QList<QAction *> actions = menu->actions();
+  if (index < 0 || index >= actions.size()) {
+    return;
+  }
+  if (QMenu *submenu = actions.at(index)->menu(); submenu != nullptr) {
+    emit submenu->aboutToShow();
+  }
+}
+
 void QtTrayMenu::clickMessage() const {
   if (!trayIcon) {
     return;
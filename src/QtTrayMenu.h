@@ -7,16 +7,27 @@
 
 // standard includes
 #include <array>
+#include <functional>
 #include <memory>
+#include <unordered_map>
+#include <vector>
 
 // qt includes
+#include <QAction>
+#include <QByteArray>
+#include <QHash>
+#include <QIcon>
 #include <QMenu>
 #include <QObject>
 #include <QPoint>
 #include <QString>
+#include <QStringList>
 #include <QSystemTrayIcon>
+#include <QThreadPool>
+#include <QTimer>
 
 // local includes
+#include "QtIconCache.h"
 #include "tray.h"
 
 /**
@@ -95,12 +106,123 @@ public:
    */
   void showMessage(const QString &title, const QString &msg, const QString &iconPath, std::function<void()> callback = nullptr, int msecs = 10000);
 
+  /**
+   * @brief Reconcile the tray context menu against the given items
+   *
+   * The top-level menu is created on first use. Submenus are only built once they are about to
+   * be shown.
+   *
+   * @param items NULL-terminated menu items
+   */
+  void updateMenu(struct tray_menu *items);
+
+  /**
+   * @brief Access the tray context menu
+   * @return the top-level menu, or nullptr if no menu was built yet
+   */
+  QMenu *contextMenu() const;
+
+  /**
+   * @brief Re-apply text and flags of a single menu item to its existing action
+   * @param item menu item that was part of the last menu update
+   * @return true if the item has a live action, false otherwise
+   */
+  bool updateMenuItem(const struct tray_menu *item);
+
+  /**
+   * @brief Show an icon held in memory
+   * @param data raw RGBA pixels or encoded image bytes, nullptr to go back to the tray structure icon
+   * @return 0 on success, -1 if the tray is not running or the data is not a readable image
+   */
+  int setIconData(const struct tray_icon_data *data);
+
+  /**
+   * @brief Cycle the tray icon through icons loaded like tray::icon
+   * @param paths icon file paths or theme names
+   * @param count number of frames
+   * @param fps frames per second
+   * @return 0 on success, -1 if the tray is not running or the arguments are invalid
+   */
+  int startIconAnimation(const char *const *paths, int count, int fps);
+
+  /**
+   * @brief Cycle the tray icon through icons held in memory
+   * @param frames raw RGBA pixels or encoded image bytes of each frame
+   * @param count number of frames
+   * @param fps frames per second
+   * @return 0 on success, -1 if the tray is not running, the arguments are invalid or a frame is not a readable image
+   */
+  int startIconAnimation(const struct tray_icon_data *frames, int count, int fps);
+
+  /**
+   * @brief Stop the icon animation and show the base icon again
+   */
+  void stopIconAnimation();
+
+  /**
+   * @brief Draw a badge over the tray icon
+   * @param text badge text, empty to remove the badge
+   */
+  void setBadge(const QString &text);
+
+  /**
+   * @brief Icon the tray currently shows, without a badge
+   * @return the icon, or a null icon before init()
+   */
+  QIcon icon() const;
+
+  /**
+   * @brief Set the callback that fills menus right before they are shown
+   * @param provider callback receiving the tray and the item whose submenu is shown (nullptr for the top-level menu)
+   */
+  void setMenuProvider(void (*provider)(struct tray *tray, struct tray_menu *parent));
+
+  /**
+   * @brief Choose where init() decodes the icons listed in tray::allIconPaths
+   * @param async decode on a worker thread if true, on the calling thread before init() returns otherwise
+   */
+  void setAsyncIconPreload(bool async);
+
+  /**
+   * @brief Choose where init() and update() decode icon files that are not cached yet
+   * @param async decode on a worker thread and keep the current icon until then if true, on the calling thread otherwise
+   */
+  void setAsyncIconDecode(bool async);
+
+  /**
+   * @brief Set the directory rasterized icons are kept in across processes
+   * @param directory existing directory, or an empty string to disable the disk cache
+   */
+  void setIconDiskCache(const QString &directory);
+
+  /**
+   * @brief Choose where menu item, left click and notification callbacks run
+   *
+   * Callbacks are sharded over single-threaded pools by the item they belong to, so the callbacks of
+   * one item run in the order they were triggered. Waits for callbacks already running on the old pools.
+   *
+   * @param count number of worker threads, 0 to run callbacks on the calling thread of the signal
+   */
+  void setCallbackThreads(int count);
+
+  /**
+   * @brief Set the object owning the tray and menu items currently shown
+   * @param owner owner kept alive by callbacks still waiting on a worker thread, empty if the caller owns them
+   */
+  void setItemOwner(std::shared_ptr<const void> owner);
+
   /**
    * @brief Simulate click on menu item
    * @param index Menu item index to simulate click on
    */
   void clickMenuItem(int index) const;
 
+  /**
+   * @brief Simulate opening the submenu of a top-level menu item
+   * @param index Menu item index whose submenu should be built
+   */
+  void openSubmenu(int index) const;
+
   /**
    * @brief Simulate click on popup message
    */
@@ -129,6 +251,12 @@ public:
    */
   static bool supportsMessages();
 
+  /**
+   * @brief Diagnostic counters collected by this tray menu
+   * @return counters accumulated since construction
+   */
+  const struct tray_stats &stats() const;
+
 signals:
   /**
    * @brief Exit tray and cleanup resources
@@ -148,10 +276,79 @@ signals:
   void showMenu() const;
 
 private:
-  void createMenu(struct tray_menu *items, QMenu *menu);
+  /**
+   * @brief Source items and build state of a menu
+   */
+  struct MenuState {
+    struct tray_menu *parentItem = nullptr;  ///< Item whose submenu this is, nullptr for the top-level menu.
+    struct tray_menu *items = nullptr;  ///< Items the menu is built from.
+    struct tray_menu_source *source = nullptr;  ///< Source the items are fetched from, if any.
+    int offset = 0;  ///< Index of the first source item shown in the menu.
+    std::vector<struct tray_menu> page;  ///< Items fetched from the source, NULL-terminated.
+    const struct tray_menu *moreItem = nullptr;  ///< Entry of the page that opens the next page.
+    std::size_t fingerprint = 0;  ///< Fingerprint of the items the menu was last built from.
+    bool built = false;  ///< Whether the menu was built at least once.
+    bool stale = true;  ///< Whether the menu must be checked against its items before it is shown.
+  };
+
+  /**
+   * @brief Icon combined from the size and scale variants of a plain icon
+   */
+  struct VariantIcon {
+    QIcon icon;  ///< Icon holding the pixmaps of every variant.
+    std::vector<QtIconCache::Decoded> members;  ///< Path, modification time and size of every variant file, without images.
+  };
+
+  /**
+   * @brief Tray icon with a badge drawn over it
+   */
+  struct BadgeComposite {
+    qint64 baseKey = 0;  ///< Cache key of the icon the badge was drawn over.
+    int extent = 0;  ///< Size the composite was drawn at.
+    QString text;  ///< Badge text.
+    QIcon icon;  ///< Composited icon.
+  };
+
+  /**
+   * @brief Dispatch table entry of a menu action
+   */
+  struct ActionSlot {
+    struct tray_menu *item = nullptr;  ///< Item bound to the action.
+    const QMenu *menu = nullptr;  ///< Menu the action is shown in.
+    int id = 0;  ///< Stable identifier of the bound item.
+  };
+
+  QAction *createAction(QMenu *menu, QAction *before, bool separator);
+  QMenu *createSubmenu(QMenu *parent);
+  void recycleAction(QAction *action);
+  void recycleMenu(QMenu *menu);
+  void invalidateMenu(const QMenu *menu);
+  void clearPools();
+  void applyItemState(QAction *action, const struct tray_menu *item) const;
+  void bindAction(QAction *action, struct tray_menu *item, QMenu *menu);
+  void removeAction(QAction *action, QMenu *menu);
+  void releaseSubmenu(QAction *action);
+  void materializeMenu(QMenu *menu);
+  static struct tray_menu *fetchSourcePage(MenuState &state);
+  void unindexAction(const QAction *action, const struct tray_menu *item);
+  void reconcileMenu(struct tray_menu *items, QMenu *menu);
   void createNotification();
-  void updateMenu(struct tray_menu *items);
-  QIcon lookupIcon(QString icon) const;
+  void preloadIcons(const struct tray *tray);
+  void storePreloadedIcons(const std::vector<QtIconCache::Decoded> &decoded);
+  void combineIconVariants(const std::vector<QtIconCache::Decoded> &decoded);
+  QIcon variantIcon(const QString &path, QStringList *changed);
+  QIcon storeDecodedIcons(const QString &path, const std::vector<QtIconCache::Decoded> &decoded);
+  void requestIcon(const char *name);
+  QIcon lookupIcon(const QString &icon);
+  void applyIcon(const QIcon &icon);
+  void showBaseIcon();
+  QIcon badgedIcon();
+  int trayIconExtent() const;
+  int runIconAnimation(const std::vector<QIcon> &icons, int fps);
+  void setIconVisible(bool visible);
+  void syncIconCacheStats();
+  void runCallback(const void *key, std::function<void()> callback);
+  void stopCallbackPools();
   int defaultArgc = 1;
   std::array<char, 12> defaultArgv0 {'T', 'r', 'a', 'y', 'M', 'e', 'n', 'u', 'A', 'p', 'p', '\0'};
   std::array<char *, 2> defaultArgv {defaultArgv0.data(), nullptr};
@@ -161,17 +358,47 @@ private:
   struct tray *trayStruct = nullptr;
   bool running = false;
   bool blockingEventLoop = false;
-  struct tray_menu *getTrayMenuItem(const QAction *action);
+  struct tray_menu *getTrayMenuItem(const QAction *action) const;
   mutable std::function<void()> notificationCallback = nullptr;
   QPoint savedMousePosition;
   bool mousePositionSaved = false;
+  struct tray_stats trayStats {};
+  std::unordered_map<const struct tray_menu *, QAction *> itemActions;
+
+  std::unordered_map<QMenu *, MenuState> menuStates;
+  std::vector<QAction *> actionPool;
+  std::vector<QMenu *> menuPool;
+  std::vector<ActionSlot> dispatchTable;
+  std::vector<std::size_t> freeSlots;
+  void (*menuProvider)(struct tray *, struct tray_menu *) = nullptr;
+  QByteArray appliedIcon;
+  qint64 appliedIconKey = 0;  ///< QIcon::cacheKey() of the icon last resolved from appliedIcon.
+  QByteArray appliedTooltip;
+  QtIconCache iconCache;
+  QHash<QString, VariantIcon> variantIcons;  ///< Icons combined from the size and scale variants listed in tray::allIconPaths.
+  QHash<QString, QIcon> themeIcons;  ///< Theme lookups by icon name, null for names the theme does not have.
+  QString themeIconsTheme;  ///< Icon theme and fallback theme themeIcons was filled from.
+  QIcon baseIcon;
+  std::vector<QIcon> animationFrames;
+  std::size_t animationFrame = 0;
+  QTimer animationTimer;
+  QString badgeText;
+  std::vector<BadgeComposite> badgeComposites;  ///< Recently drawn badges, most recently used first.
+  bool asyncIconPreload = false;
+  bool asyncIconDecode = false;
+  quint64 iconGeneration = 0;  ///< Bumped whenever the icon is changed, so stale asynchronous decodes are dropped.
+  QThreadPool iconLoader;
+  std::vector<std::unique_ptr<QThreadPool>> callbackPools;  ///< Single-threaded pools callbacks are sharded over, empty to run them inline.
+  std::shared_ptr<const void> itemOwner;  ///< Owner of the items shown, see setItemOwner().
 
 private slots:
   void onExitRequested();
-  void onMessageClicked() const;
-  void onMenuItemTriggered();
+  void onMessageClicked();
+  void onMenuTriggered(QAction *action);
+  void onMenuAboutToShow();
   void onTrayActivated(QSystemTrayIcon::ActivationReason reason);
   void onShowMenu() const;
   void onUpdate(struct tray *tray, bool notify);
+  void onAnimationFrame();
 };
 #endif  // TRAYMENU_H
@@ -5,6 +5,8 @@
 #ifndef TRAY_H
 #define TRAY_H
 
+#include <stddef.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -14,6 +16,37 @@ extern "C" {
    */
   struct tray_menu;
 
+  /**
+   * @brief Source producing the items of a submenu on demand.
+   *
+   * The items are fetched a page at a time when the submenu is about to be shown, so very long
+   * lists never need to exist as a NULL-terminated tray_menu array. When more items remain after
+   * a page, a trailing "More…" entry opens the next page. The source is asked again every time
+   * the submenu is shown. Callbacks of source items get a copy of the item, so the strings set by
+   * get_item must stay valid until those callbacks ran.
+   */
+  struct tray_menu_source {
+    int (*count)(struct tray_menu_source *source);  ///< Return the current number of items.
+    void (*get_item)(struct tray_menu_source *source, int index, struct tray_menu *item);  ///< Fill in the zeroed item at index.
+    void *context;  ///< Context available to the callbacks.
+    int page_size;  ///< Number of items shown per page, 0 for the default.
+  };
+
+  /**
+   * @brief Icon image held in memory.
+   *
+   * With a width and height, `data` points at raw RGBA pixels: 4 bytes per pixel in R, G, B, A
+   * order, not premultiplied, with `stride` bytes per row. Otherwise `data` holds `size` bytes of
+   * an encoded image file such as PNG, SVG or ICO.
+   */
+  struct tray_icon_data {
+    const void *data;  ///< Pixels or encoded image bytes.
+    size_t size;  ///< Number of bytes at data, required for encoded images.
+    int width;  ///< Width in pixels of raw RGBA data, 0 for encoded images.
+    int height;  ///< Height in pixels of raw RGBA data, 0 for encoded images.
+    int stride;  ///< Bytes per row of raw RGBA data, 0 for tightly packed rows.
+  };
+
   /**
    * @brief Tray icon.
    */
@@ -27,7 +60,7 @@ extern "C" {
     void (*cb)(struct tray *);  ///< Callback for left click, leave null to just open menu
     struct tray_menu *menu;  ///< Menu items.
     const int iconPathCount;  ///< Number of icon paths.
-    const char *allIconPaths[];  ///< Array of icon paths.
+    const char *allIconPaths[];  ///< Array of icon paths, preloaded by tray_init(). Variants such as icon@2x.png or icon-22.png are combined with icon.png.
   };
 
   /**
@@ -43,10 +76,58 @@ extern "C" {
     void *context;  ///< Context to pass to the callback.
 
     struct tray_menu *submenu;  ///< Submenu items.
+    struct tray_menu_source *source;  ///< Source of the submenu items, used instead of submenu when set.
+    int id;  ///< Optional stable identifier, 0 for none. Keeps the item's menu entry across reorders.
+  };
+
+  /**
+   * @brief Tray diagnostic counters.
+   */
+  struct tray_stats {
+    unsigned long long menu_actions_created;  ///< Menu actions allocated while building or updating the menu.
+    unsigned long long menu_actions_reused;  ///< Existing menu actions patched in place by a menu update.
+    unsigned long long menu_actions_recycled;  ///< Menu actions taken from the pool of previously removed actions.
+    unsigned long long menus_created;  ///< Submenus allocated while building or updating the menu.
+    unsigned long long menus_recycled;  ///< Submenus taken from the pool of previously removed submenus.
+    unsigned long long menus_materialized;  ///< Menus reconciled against changed items, either on update or right before being shown.
+    unsigned long long menus_skipped;  ///< Menu reconciliations skipped because the menu items were unchanged.
+    unsigned long long icon_updates_applied;  ///< Tray icon changes applied by tray_update().
+    unsigned long long icon_updates_skipped;  ///< Tray icon changes skipped by tray_update() because the icon was unchanged.
+    unsigned long long tooltip_updates_applied;  ///< Tooltip changes applied by tray_update().
+    unsigned long long tooltip_updates_skipped;  ///< Tooltip changes skipped by tray_update() because the tooltip was unchanged.
+    unsigned long long menu_provider_calls;  ///< Calls made to the callback registered with tray_set_menu_provider().
+    unsigned long long updates_batched;  ///< tray_update() and tray_menu_item_update() calls deferred to a tray_update_commit().
+    unsigned long long icon_cache_hits;  ///< Icon file lookups answered from the decoded icon cache.
+    unsigned long long icon_cache_misses;  ///< Icon file lookups that had to load and decode the file.
+    unsigned long long icons_preloaded;  ///< Icons from tray::allIconPaths decoded ahead of use by tray_init().
+    unsigned long long icon_data_updates;  ///< Icons applied from memory by tray_set_icon_data().
+    unsigned long long animation_frames_shown;  ///< Frames shown by icon animations.
+    unsigned long long svg_renders;  ///< SVG icon files rendered into pixmaps at the usual tray icon sizes.
+    unsigned long long svg_render_time_us;  ///< Time spent rendering SVG icon files, in microseconds.
+    unsigned long long icon_disk_cache_hits;  ///< Icons loaded from the tray_set_icon_disk_cache() directory instead of their files.
+    unsigned long long icon_disk_cache_writes;  ///< Rasterized icons written to the tray_set_icon_disk_cache() directory.
+    unsigned long long badge_composites_rendered;  ///< Badges drawn over the tray icon.
+    unsigned long long badge_composites_reused;  ///< Badges shown from the cache of recently drawn badges.
+    unsigned long long theme_icon_hits;  ///< Icon theme lookups answered from earlier lookups, including names that did not resolve.
+    unsigned long long theme_icon_misses;  ///< Icon theme lookups that searched the theme.
+    unsigned long long icons_decoded_async;  ///< Icons decoded on a worker thread after tray_set_async_icon_decode().
+    unsigned long long icon_variants_combined;  ///< Size and scale variants from tray::allIconPaths combined into multi-resolution icons.
+    unsigned long long updates_coalesced;  ///< Tray updates replaced by a newer one before the UI thread applied them.
+    unsigned long long commands_queued;  ///< tray_update(), tray_update_async() and tray_menu_item_update() calls queued for the UI thread.
+    unsigned long long command_wakeups;  ///< Times the UI thread was woken to apply queued calls.
+    unsigned long long command_queue_full;  ///< Calls that found the queue to the UI thread full; tray_update_async() is then coalesced instead of waiting.
+    unsigned long long command_batch_peak;  ///< Most calls the UI thread applied after a single wakeup.
+    unsigned long long callbacks_offloaded;  ///< Callbacks run on the tray_set_callback_threads() workers instead of the UI thread.
   };
 
   /**
    * @brief Create tray icon.
+   *
+   * tray_init() and tray_loop() must be called on the UI thread. Every other function may be
+   * called from any thread once tray_init() succeeded. tray_update(), tray_update_commit() and calls
+   * reporting a result from the UI thread wait for it; all other calls, including settings that
+   * only check their arguments, are handed to the UI thread without waiting.
+   *
    * @param tray The tray to initialize.
    * @return 0 on success, -1 on error.
    */
@@ -61,10 +142,127 @@ extern "C" {
 
   /**
    * @brief Update the tray icon and menu.
+   *
+   * Returns once the UI thread shows this update or a newer one. Updates from other threads that
+   * arrive while the UI thread is busy are coalesced, so only the newest one is applied.
+   *
    * @param tray The tray to update.
    */
   void tray_update(struct tray *tray);
 
+  /**
+   * @brief Update the tray icon and menu without waiting for the UI thread.
+   *
+   * Copies the tray, including all strings and the whole menu tree, and returns right away; the
+   * copy is applied on the UI thread later, unless a newer update replaces it first. The caller may
+   * change or release its tray data as soon as this function returns. Callbacks of items applied
+   * this way receive the copied items and `tray->cb` receives the copied tray; these are valid
+   * until the next update. Menu sources and callback contexts are not copied and must stay valid.
+   * tray_update() keeps waiting for the UI thread as before.
+   *
+   * @param tray The tray to update.
+   * @param completion Optional callback invoked on the UI thread once this update or a newer one is
+   *   applied, with the tray pointer and context passed to this function.
+   * @param context Context passed to the completion callback.
+   */
+  void tray_update_async(struct tray *tray, void (*completion)(struct tray *tray, void *context), void *context);
+
+  /**
+   * @brief Update a single menu item without rebuilding the tray.
+   *
+   * Re-applies the text, checked, disabled and checkbox state of an item that was part of the
+   * menu passed to the last tray_init() or tray_update(). The icon, tooltip and the rest of the
+   * menu are left untouched. Changes to the item's submenu require tray_update().
+   *
+   * @param item The menu item to update.
+   */
+  void tray_menu_item_update(struct tray_menu *item);
+
+  /**
+   * @brief Show an icon held in memory instead of writing it to a file first.
+   *
+   * Raw RGBA pixels are read in place and converted into the platform pixmap once; encoded images
+   * are decoded straight from the buffer. The memory only needs to stay valid until this function
+   * returns. The icon stays until the next call, or until tray_update() applies a different
+   * `tray->icon`.
+   *
+   * @param icon The icon to show, or NULL to go back to `tray->icon`.
+   * @return 0 on success, -1 if the tray is not running, the data cannot be read as an image or
+   *         `size` or `stride` exceed INT_MAX.
+   */
+  int tray_set_icon_data(const struct tray_icon_data *icon);
+
+  /**
+   * @brief Animate the tray icon by cycling through a sequence of icons.
+   *
+   * Every frame is loaded like `tray->icon` and rasterized once at the tray icon size; the UI thread
+   * then switches frames on a timer, so no tray_update() calls are needed to drive the animation.
+   * Frames are not advanced while the icon is hidden. Starting a new animation replaces the
+   * running one.
+   *
+   * @param paths Icon file paths or theme names, one per frame.
+   * @param count Number of frames.
+   * @param fps Frames per second, capped at 60.
+   * @return 0 on success, -1 if the tray is not running or the arguments are invalid.
+   */
+  int tray_set_icon_animation(const char *const *paths, int count, int fps);
+
+  /**
+   * @brief Animate the tray icon by cycling through icons held in memory.
+   *
+   * Same as tray_set_icon_animation(), with frames given like tray_set_icon_data(). The memory only
+   * needs to stay valid until this function returns.
+   *
+   * @param frames Icon data, one per frame.
+   * @param count Number of frames.
+   * @param fps Frames per second, capped at 60.
+   * @return 0 on success, -1 if the tray is not running, the arguments are invalid or a frame cannot be read as an image.
+   */
+  int tray_set_icon_animation_data(const struct tray_icon_data *frames, int count, int fps);
+
+  /**
+   * @brief Stop the icon animation and show the current icon again.
+   */
+  void tray_stop_icon_animation(void);
+
+  /**
+   * @brief Draw a number badge over the tray icon.
+   *
+   * The badge stays over every icon later applied by tray_update() or tray_set_icon_data().
+   * Badged icons are cached per icon and badge, so switching between recent values does not
+   * draw them again.
+   *
+   * @param count Number to show, shown as "99+" above 99. 0 or less removes the badge.
+   */
+  void tray_set_badge(int count);
+
+  /**
+   * @brief Draw a text badge over the tray icon.
+   *
+   * Same as tray_set_badge() with arbitrary text, which should be kept to a few characters.
+   *
+   * @param text Text to show. NULL or an empty string removes the badge.
+   */
+  void tray_set_badge_text(const char *text);
+
+  /**
+   * @brief Start grouping tray updates made by the calling thread.
+   *
+   * Until the matching tray_update_commit(), tray_update() and tray_menu_item_update() calls
+   * made by the same thread are only recorded. Calls may be nested; only the outermost commit
+   * applies the recorded changes.
+   */
+  void tray_update_begin(void);
+
+  /**
+   * @brief Apply the updates recorded since tray_update_begin() in a single pass.
+   *
+   * The icon, tooltip, menu and notification of the last tray passed to tray_update() are applied
+   * once, in one trip to the UI thread. Without a recorded tray_update(), only the recorded menu
+   * items are updated. Like tray_update(), this waits until the changes are applied.
+   */
+  void tray_update_commit(void);
+
   /**
    * @brief Force show the tray menu (for testing purposes).
    */
@@ -99,8 +297,37 @@ extern "C" {
    */
   void tray_simulate_menu_item_click(int index);
 
+  /**
+   * @brief Simulate opening the submenu of a top-level menu item by index (for testing purposes).
+   *
+   * Builds the submenu as if it was about to be shown. Items without a submenu are ignored.
+   *
+   * @param index Zero-based index in the top-level tray menu.
+   */
+  void tray_simulate_submenu_open(int index);
+
+  /**
+   * @brief Get the sizes the tray icon holds pixmaps for (for testing purposes).
+   * @param sizes Set to the widths of the available sizes in pixels, may be NULL.
+   * @param count Number of entries sizes can hold.
+   * @return The number of available sizes, or -1 if the tray shows no icon.
+   */
+  int tray_get_icon_sizes(int *sizes, int count);
+
+  /**
+   * @brief Get the pixmap the tray icon draws at a size (for testing purposes).
+   * @param size Edge length in device independent pixels.
+   * @param ratio Device pixel ratio to draw for.
+   * @param width Set to the width of the pixmap in device pixels.
+   * @param pixel_ratio Set to the device pixel ratio of the pixmap.
+   * @return 0 on success, -1 if the tray shows no icon or, before Qt 6, ratio differs from the screen's.
+   */
+  int tray_get_icon_pixmap(int size, double ratio, int *width, double *pixel_ratio);
+
   /**
    * @brief Terminate UI loop.
+   *
+   * From another thread, the UI loop stops once the UI thread gets to the request.
    */
   void tray_exit(void);
 
@@ -115,6 +342,76 @@ extern "C" {
    */
   void tray_set_log_callback(void (*cb)(int level, const char *msg));
 
+  /**
+   * @brief Choose where tray_init() decodes the icons listed in `tray->allIconPaths`.
+   *
+   * tray_init() decodes every listed icon up front, so a later tray_update() that switches to one of
+   * them only swaps a prepared pixmap. By default this happens before tray_init() returns; when
+   * enabled, the files are decoded on a worker thread and handed to the UI thread once ready.
+   * Applies to the next tray_init().
+   *
+   * @param enabled Non-zero to decode on a worker thread, 0 to decode during tray_init().
+   */
+  void tray_set_async_icon_preload(int enabled);
+
+  /**
+   * @brief Choose where tray_init() and tray_update() decode icon files.
+   *
+   * By default an icon file that is not cached yet is decoded on the UI thread, which stalls menu
+   * interaction and event processing while a large file is read. When enabled, the file is decoded
+   * on a worker thread and the previous icon stays visible until the new one is ready. Cached icons
+   * and theme icon names are still applied right away.
+   *
+   * @param enabled Non-zero to decode on a worker thread, 0 to decode on the UI thread.
+   */
+  void tray_set_async_icon_decode(int enabled);
+
+  /**
+   * @brief Run callbacks on worker threads so a slow callback never freezes the tray.
+   *
+   * Off by default, when menu item callbacks, `tray->cb` and `notification_cb` run on the UI
+   * thread. With workers, each callback is handed to a worker chosen by the item it belongs to, so
+   * the callbacks of one item still run one at a time in the order they were triggered, while
+   * other items run in parallel. Callbacks then read their items while the UI thread may update
+   * them, and items must stay valid until their callbacks ran; copies made by tray_update_async()
+   * are kept alive for them. tray_exit() waits for the callbacks still running, and the next
+   * tray_init() starts new workers. Must not be called from a callback.
+   *
+   * @param count Number of worker threads, 0 to run callbacks on the UI thread.
+   * @return 0 on success, -1 if count is negative.
+   */
+  int tray_set_callback_threads(int count);
+
+  /**
+   * @brief Keep rasterized icons in a directory so later processes can skip parsing them.
+   *
+   * Rendered SVG and decoded ICO icons are written to the directory as raw pixels, keyed by a hash of
+   * the file content and the device pixel ratio. A later process memory-maps them instead of parsing
+   * the files again; an edited file hashes differently and is rasterized again. Off by default.
+   *
+   * Every write prunes the directory: files unused for 30 days are removed, and only the 256 most
+   * recently used ones are kept. Other files in the directory are left alone.
+   *
+   * @param directory Cache directory, created if missing. An empty string selects `tray` in the
+   *   user's cache directory (`$XDG_CACHE_HOME/tray` on Linux). NULL turns the disk cache off.
+   * @return 0 on success, -1 if the directory cannot be created.
+   */
+  int tray_set_icon_disk_cache(const char *directory);
+
+  /**
+   * @brief Set a callback that fills or refreshes menus right before they are shown.
+   *
+   * The callback runs on the UI thread whenever the top-level menu or a submenu is about to be
+   * shown. It may change the items in place or point `tray->menu` (top-level menu) or
+   * `parent->submenu` (submenu) at new items; the menu is reconciled against them once the callback
+   * returns. This lets applications skip tray_update() calls that only keep an unopened menu current.
+   * Submenus backed by a tray_menu_source are not passed to the callback.
+   *
+   * @param provider Callback invoked with the tray and the item whose submenu is about to be shown,
+   *   or NULL for the top-level menu. Pass NULL to remove the callback.
+   */
+  void tray_set_menu_provider(void (*provider)(struct tray *tray, struct tray_menu *parent));
+
   /**
    * @brief Set application metadata used by the tray library.
    *
@@ -131,6 +428,16 @@ extern "C" {
    */
   void tray_set_app_info(const char *app_name, const char *app_display_name, const char *desktop_name);
 
+  /**
+   * @brief Read the tray diagnostic counters.
+   *
+   * Counters accumulate for the lifetime of the process and are not reset by tray_exit(). From
+   * another thread, this waits for the UI thread to copy the counters.
+   *
+   * @param stats Receives the current counters. Zeroed if the tray was never initialized.
+   */
+  void tray_get_stats(struct tray_stats *stats);
+
 #ifdef __cplusplus
 }  // extern "C"
 #endif
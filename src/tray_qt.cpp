@@ -3,31 +3,128 @@
  * @brief System tray implementation using Qt.
  */
 // standard includes
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <iterator>
 #include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <utility>
+#include <vector>
 
 // qt includes
 #include <QByteArray>
 #include <QDebug>
+#include <QDir>
+#include <QGuiApplication>
+#include <QIcon>
 #include <QMessageLogContext>
 #include <QMetaObject>
+#include <QPixmap>
+#include <QStandardPaths>
 #include <QString>
 #include <QThread>
 
 // local includes
+#include "MpscQueue.h"
 #include "QtTrayMenu.h"
 #include "tray.h"
 
 namespace tray_qt {
+  /**
+   * @brief Owned copy of a tray and its menu tree, handed to the UI thread by tray_update_async().
+   */
+  struct Snapshot {
+    std::vector<std::max_align_t> storage;  ///< Storage of the copied tray, including its icon path array.
+    std::deque<std::string> strings;  ///< Copied strings, whose addresses stay stable as more are added.
+    std::deque<std::vector<struct tray_menu>> menus;  ///< Copied NULL-terminated menu levels.
+    struct tray *tray = nullptr;  ///< The copied tray.
+  };
+
+  /**
+   * @brief Completion callback of tray_update_async() with the tray and context it was given.
+   */
+  using Completion = std::tuple<void (*)(struct tray *, void *), struct tray *, void *>;
+
+  /**
+   * @brief Caller of a blocking command, waiting until the UI thread applied it.
+   */
+  struct Waiter {
+    bool done = false;  ///< Set under State::commandMutex once the command was applied or replaced.
+  };
+
+  /**
+   * @brief Request handed to the UI thread through the command queue.
+   */
+  struct Command {
+    struct tray *tray = nullptr;  ///< Tray to apply, nullptr for a single item update.
+    std::shared_ptr<Snapshot> snapshot;  ///< Snapshot owning tray for tray_update_async(), empty otherwise.
+    struct tray_menu *item = nullptr;  ///< Item to refresh when tray is nullptr.
+    Completion completion {};  ///< Completion callback of tray_update_async(), may hold nullptr.
+    Waiter *waiter = nullptr;  ///< Blocking caller to release once applied, nullptr if nobody waits.
+    unsigned long long sequence = 0;  ///< Order in which the command was posted.
+  };
+
+  /**
+   * @brief Newest tray_update_async() that found the command queue full.
+   */
+  struct Overflow {
+    Command command;  ///< Pending update, without a tray if there is none.
+    std::vector<Completion> replaced;  ///< Completions of the pending updates it replaced, oldest first.
+  };
+
+  /**
+   * @brief Number of commands that can wait for the UI thread before further ones wait or coalesce.
+   */
+  constexpr std::size_t COMMAND_QUEUE_CAPACITY = 256;
+
   /**
    * @brief Process-wide state backing the C tray API.
    */
   struct State {
-    std::unique_ptr<QtTrayMenu> trayMenu;  ///< Active tray menu instance.
-    void (*logCallback)(int, const char *) = nullptr;  ///< Registered C logging callback.
+    std::unique_ptr<QtTrayMenu> trayMenu;  ///< Active tray menu instance, only created by tray_init() on the UI thread.
+    std::atomic<void (*)(int, const char *)> logCallback {nullptr};  ///< Registered C logging callback.
+    std::atomic<void (*)(struct tray *, struct tray_menu *)> menuProvider {nullptr};  ///< Registered just-in-time menu callback.
+    std::atomic<bool> asyncIconPreload {false};  ///< Whether tray_init() decodes listed icons on a worker thread.
+    std::atomic<bool> asyncIconDecode {false};  ///< Whether icon files are decoded on a worker thread.
+    std::atomic<int> callbackThreads {0};  ///< Number of worker threads callbacks run on, 0 for the UI thread.
+    std::mutex settingsMutex;  ///< Guards the settings below, which any thread may change.
+    QString iconDiskCache;  ///< Directory rasterized icons are kept in, empty if disabled.
     bool appInfoConfigured = false;  ///< Whether application metadata was explicitly configured.
     QString appName;  ///< Configured application name.
     QString appDisplayName;  ///< Configured application display name.
     QString desktopName;  ///< Configured desktop file name.
+    std::atomic<unsigned long long> updatesBatched {0};  ///< Updates folded into a tray_update_commit().
+    std::shared_ptr<Snapshot> appliedSnapshot;  ///< Snapshot the tray menu currently shows, only touched on the UI thread.
+    MpscQueue<Command, COMMAND_QUEUE_CAPACITY> commands;  ///< Commands waiting for the UI thread.
+    std::atomic<bool> drainQueued {false};  ///< Whether the UI thread was already woken to drain the commands.
+    std::atomic<unsigned long long> nextSequence {0};  ///< Sequence number of the next posted command.
+    std::mutex overflowMutex;  ///< Guards overflow.
+    Overflow overflow;  ///< Update coalesced outside the full command queue.
+    std::mutex commandMutex;  ///< Guards Waiter::done and drains.
+    unsigned long long drains = 0;  ///< Batches of commands applied so far.
+    std::condition_variable commandsApplied;  ///< Signaled whenever a batch of commands was applied.
+    std::atomic<unsigned long long> updatesCoalesced {0};  ///< Updates replaced by a newer one before they were applied.
+    std::atomic<unsigned long long> commandsQueued {0};  ///< Commands pushed to the command queue.
+    std::atomic<unsigned long long> commandWakeups {0};  ///< Times the UI thread was woken to drain commands.
+    std::atomic<unsigned long long> commandQueueFull {0};  ///< Times a producer found the command queue full.
+    std::atomic<unsigned long long> commandBatchPeak {0};  ///< Most commands drained after a single wakeup.
+  };
+
+  /**
+   * @brief Updates recorded between tray_update_begin() and tray_update_commit() on one thread.
+   */
+  struct Batch {
+    int depth = 0;  ///< Number of open tray_update_begin() calls.
+    struct tray *tray = nullptr;  ///< Tray passed to the last tray_update() of the batch.
+    std::vector<struct tray_menu *> items;  ///< Items passed to tray_menu_item_update() during the batch.
   };
 
   /**
@@ -39,6 +136,47 @@ namespace tray_qt {
     return instance;
   }
 
+  /**
+   * @brief Access the update batch of the calling thread.
+   * @return Mutable batch state.
+   */
+  Batch &batch() {
+    thread_local Batch instance;
+    return instance;
+  }
+
+  /**
+   * @brief Run a function on the thread owning the tray menu and wait for it to finish.
+   * @param apply Function to run.
+   */
+  void run_blocking(const std::function<void()> &apply) {
+    const auto *tray_menu = state().trayMenu.get();
+    if (QThread::currentThread() == tray_menu->thread()) {
+      apply();
+      return;
+    }
+
+    // Keep the C API synchronous so callers can safely reuse or release tray data after this function returns.
+    (void) QMetaObject::invokeMethod(state().trayMenu.get(), apply, Qt::BlockingQueuedConnection);
+  }
+
+  /**
+   * @brief Run a function on the thread owning the tray menu without waiting for it.
+   *
+   * On that thread itself the function runs right away, so callers there see its effect as before.
+   *
+   * @param apply Function to run.
+   */
+  void run_async(std::function<void()> apply) {
+    auto *const tray_menu = state().trayMenu.get();
+    if (QThread::currentThread() == tray_menu->thread()) {
+      apply();
+      return;
+    }
+
+    QMetaObject::invokeMethod(tray_menu, std::move(apply), Qt::QueuedConnection);
+  }
+
   /**
    * @brief Acknowledge/click current notification.
    */
@@ -75,20 +213,282 @@ namespace tray_qt {
     }
   }
 
+  /**
+   * @brief Copy a string into a snapshot.
+   * @param snapshot Snapshot owning the copy.
+   * @param text String to copy, may be nullptr.
+   * @return The copy, or nullptr.
+   */
+  const char *copy_string(Snapshot &snapshot, const char *text) {
+    return text != nullptr ? snapshot.strings.emplace_back(text).c_str() : nullptr;
+  }
+
+  /**
+   * @brief Copy a menu level and all its submenus into a snapshot.
+   * @param snapshot Snapshot owning the copy.
+   * @param items NULL-terminated menu items, may be nullptr.
+   * @return The copied items, or nullptr.
+   */
+  struct tray_menu *copy_menu(Snapshot &snapshot, const struct tray_menu *items) {
+    if (items == nullptr) {
+      return nullptr;
+    }
+    std::size_t count = 0;
+    while (items[count].text != nullptr) {
+      count++;
+    }
+    auto &menu = snapshot.menus.emplace_back(items, items + count + 1);
+    for (std::size_t i = 0; i < count; i++) {
+      menu[i].text = copy_string(snapshot, items[i].text);
+      menu[i].submenu = copy_menu(snapshot, items[i].submenu);
+    }
+    return menu.data();
+  }
+
+  /**
+   * @brief Copy a tray, its strings and its menu tree.
+   * @param tray Tray to copy.
+   * @return The snapshot owning the copy.
+   */
+  std::shared_ptr<Snapshot> make_snapshot(const struct tray *tray) {
+    auto snapshot = std::make_shared<Snapshot>();
+    const auto iconPathCount = static_cast<std::size_t>(std::max(tray->iconPathCount, 0));
+    const std::size_t bytes = sizeof(struct tray) + iconPathCount * sizeof(const char *);
+    snapshot->storage.resize((bytes + sizeof(std::max_align_t) - 1) / sizeof(std::max_align_t));
+    std::memcpy(snapshot->storage.data(), tray, bytes);
+
+    auto *copy = reinterpret_cast<struct tray *>(snapshot->storage.data());
+    copy->icon = copy_string(*snapshot, tray->icon);
+    copy->tooltip = copy_string(*snapshot, tray->tooltip);
+    copy->notification_icon = copy_string(*snapshot, tray->notification_icon);
+    copy->notification_text = copy_string(*snapshot, tray->notification_text);
+    copy->notification_title = copy_string(*snapshot, tray->notification_title);
+    copy->menu = copy_menu(*snapshot, tray->menu);
+    for (std::size_t i = 0; i < iconPathCount; i++) {
+      copy->allIconPaths[i] = copy_string(*snapshot, tray->allIconPaths[i]);
+    }
+    snapshot->tray = copy;
+    return snapshot;
+  }
+
+  /**
+   * @brief Apply every queued command on the UI thread.
+   *
+   * Only the newest tray update of a batch is applied. It reconciles the whole menu, so item
+   * updates queued before it are dropped as well. An update left in the overflow slot joins the
+   * batch at the position it was posted at.
+   */
+  void drain_commands() {
+    auto &current = state();
+    // Cleared first, so a command pushed while draining wakes the UI thread again instead of being left behind
+    current.drainQueued.store(false);
+    std::vector<Command> batch;
+    Command command;
+    while (current.commands.pop(command)) {
+      batch.push_back(std::move(command));
+    }
+    // Taken after the queue, so it sees the overflow of any thread whose later command was just popped
+    std::vector<Completion> replaced;
+    unsigned long long overflowSequence = 0;
+    {
+      std::lock_guard lock(current.overflowMutex);
+      if (current.overflow.command.tray != nullptr) {
+        overflowSequence = current.overflow.command.sequence;
+        replaced = std::move(current.overflow.replaced);
+        batch.push_back(std::move(current.overflow.command));
+        current.overflow = Overflow();
+        std::stable_sort(batch.begin(), batch.end(), [](const Command &left, const Command &right) {
+          return left.sequence < right.sequence;
+        });
+      }
+    }
+    if (batch.empty()) {
+      return;
+    }
+    if (batch.size() > current.commandBatchPeak.load()) {
+      current.commandBatchPeak.store(batch.size());
+    }
+
+    const auto newest = std::find_if(batch.rbegin(), batch.rend(), [](const Command &queued) {
+      return queued.tray != nullptr;
+    });
+    auto first = batch.begin();
+    if (newest != batch.rend()) {
+      first = std::prev(newest.base());
+      current.updatesCoalesced += static_cast<unsigned long long>(std::count_if(batch.begin(), first, [](const Command &queued) {
+        return queued.tray != nullptr;
+      }));
+      // The menu and any callback still point into the previous snapshot until the new tray is applied
+      const std::shared_ptr<Snapshot> previous = current.appliedSnapshot;
+      // Swapped in before the update, which may run a nested update; the batch keeps this snapshot alive until then
+      current.appliedSnapshot = first->snapshot;
+      current.trayMenu->setItemOwner(first->snapshot);
+      current.trayMenu->update(first->tray, false);
+      notify(first->tray);
+      ++first;
+    }
+    for (auto it = first; it != batch.end(); ++it) {
+      current.trayMenu->updateMenuItem(it->item);
+    }
+
+    {
+      std::lock_guard lock(current.commandMutex);
+      for (const Command &queued : batch) {
+        if (queued.waiter != nullptr) {
+          queued.waiter->done = true;
+        }
+      }
+      current.drains++;
+    }
+    current.commandsApplied.notify_all();
+    for (const Command &queued : batch) {
+      if (queued.tray != nullptr && queued.sequence == overflowSequence) {
+        for (const auto &[completion, tray, context] : replaced) {
+          if (completion != nullptr) {
+            completion(tray, context);
+          }
+        }
+      }
+      if (const auto &[completion, tray, context] = queued.completion; completion != nullptr) {
+        completion(tray, context);
+      }
+    }
+  }
+
+  /**
+   * @brief Keep an update that found the command queue full, replacing an update kept before.
+   * @param command tray_update_async() command to keep.
+   */
+  void overflow_command(Command command) {
+    auto &current = state();
+    std::lock_guard lock(current.overflowMutex);
+    if (Command &pending = current.overflow.command; pending.tray != nullptr) {
+      current.updatesCoalesced++;
+      current.overflow.replaced.push_back(pending.completion);
+    }
+    current.overflow.command = std::move(command);
+  }
+
+  /**
+   * @brief Push a command to the command queue, waiting for room if it is full.
+   * @param command Command to push.
+   */
+  void push_command(Command &command) {
+    auto &current = state();
+    const bool ui_thread = QThread::currentThread() == current.trayMenu->thread();
+    for (;;) {
+      unsigned long long drained = 0;
+      if (!ui_thread) {
+        std::lock_guard lock(current.commandMutex);
+        drained = current.drains;
+      }
+      if (current.commands.push(command)) {
+        return;
+      }
+      if (ui_thread) {
+        // Catch up right here, nobody else will
+        drain_commands();
+        continue;
+      }
+      // A full queue always has a wakeup pending, so the UI thread drains it
+      std::unique_lock lock(current.commandMutex);
+      current.commandsApplied.wait(lock, [&current, drained]() {
+        return current.drains != drained;
+      });
+    }
+  }
+
+  /**
+   * @brief Queue a command and wake the UI thread unless it is already due to drain the queue.
+   *
+   * When the queue is full, a tray_update_async() command is coalesced into the overflow slot
+   * instead of waiting, other commands wait until the UI thread made room.
+   *
+   * @param command Command to queue.
+   */
+  void post_command(Command command) {
+    auto &current = state();
+    command.sequence = current.nextSequence++;
+    if (!current.commands.push(command)) {
+      current.commandQueueFull++;
+      if (command.snapshot != nullptr) {
+        overflow_command(std::move(command));
+      } else {
+        push_command(command);
+      }
+    }
+    current.commandsQueued++;
+    if (!current.drainQueued.exchange(true)) {
+      current.commandWakeups++;
+      QMetaObject::invokeMethod(
+        current.trayMenu.get(),
+        []() {
+          drain_commands();
+        },
+        Qt::QueuedConnection
+      );
+    }
+  }
+
+  /**
+   * @brief Queue a command and wait until the UI thread applied it, or a newer update replaced it.
+   * @param command Command to run.
+   */
+  void run_command(Command command) {
+    auto &current = state();
+    Waiter waiter;
+    command.waiter = &waiter;
+    post_command(std::move(command));
+    if (QThread::currentThread() == current.trayMenu->thread()) {
+      // A producer still writing an earlier slot can hold the command back for a moment
+      while (!waiter.done) {
+        drain_commands();
+        if (!waiter.done) {
+          std::this_thread::yield();
+        }
+      }
+      return;
+    }
+
+    std::unique_lock lock(current.commandMutex);
+    current.commandsApplied.wait(lock, [&waiter]() {
+      return waiter.done;
+    });
+  }
+
+  /**
+   * @brief Apply a tray owned by the caller and wait until it, or a newer update, is shown.
+   * @param tray Tray to apply.
+   */
+  void update_blocking(struct tray *tray) {
+    Command command;
+    command.tray = tray;
+    run_command(std::move(command));
+  }
+
   /**
    * @brief Apply configured Qt application metadata to the active Qt tray menu.
    * @param allow_defaults Whether empty app info values should apply fallback defaults.
    */
   void apply_app_info(const bool allow_defaults = true) {
-    const auto &current_state = state();
-    if (!current_state.appInfoConfigured || current_state.trayMenu == nullptr) {
-      return;
+    auto &current_state = state();
+    QString app_name;
+    QString app_display_name;
+    QString desktop_name;
+    {
+      std::lock_guard lock(current_state.settingsMutex);
+      if (!current_state.appInfoConfigured || current_state.trayMenu == nullptr) {
+        return;
+      }
+      app_name = current_state.appName;
+      app_display_name = current_state.appDisplayName;
+      desktop_name = current_state.desktopName;
     }
-    if (!allow_defaults && current_state.appName.isEmpty() && current_state.appDisplayName.isEmpty()) {
+    if (!allow_defaults && app_name.isEmpty() && app_display_name.isEmpty()) {
       return;
     }
 
-    current_state.trayMenu->configureAppMetadata(current_state.appName, current_state.appDisplayName, current_state.desktopName);
+    current_state.trayMenu->configureAppMetadata(app_name, app_display_name, desktop_name);
   }
 
   /**
@@ -111,7 +511,8 @@ namespace tray_qt {
    * @param msg The message string.
    */
   void qt_message_handler(QtMsgType type, const QMessageLogContext &, const QString &msg) {
-    if (state().logCallback == nullptr) {
+    const auto log_callback = state().logCallback.load();
+    if (log_callback == nullptr) {
       return;
     }
     int level;
@@ -129,19 +530,26 @@ namespace tray_qt {
         level = 3;
         break;
     }
-    state().logCallback(level, msg.toUtf8().constData());
+    log_callback(level, msg.toUtf8().constData());
   }
 }  // namespace tray_qt
 
 extern "C" {
   void tray_set_app_info(const char *app_name, const char *app_display_name, const char *desktop_name) {
     auto &state = tray_qt::state();
-    state.appInfoConfigured = true;
-    state.appName = app_name != nullptr ? QString::fromUtf8(app_name) : QString();
-    state.appDisplayName = app_display_name != nullptr ? QString::fromUtf8(app_display_name) : QString();
-    state.desktopName = desktop_name != nullptr ? QString::fromUtf8(desktop_name) : QString();
+    {
+      std::lock_guard lock(state.settingsMutex);
+      state.appInfoConfigured = true;
+      state.appName = app_name != nullptr ? QString::fromUtf8(app_name) : QString();
+      state.appDisplayName = app_display_name != nullptr ? QString::fromUtf8(app_display_name) : QString();
+      state.desktopName = desktop_name != nullptr ? QString::fromUtf8(desktop_name) : QString();
+    }
 
-    tray_qt::apply_app_info();
+    if (state.trayMenu != nullptr) {
+      tray_qt::run_async([]() {
+        tray_qt::apply_app_info();
+      });
+    }
   }
 
   int tray_init(struct tray *tray) {
@@ -150,14 +558,27 @@ extern "C" {
       tray_qt::configure_platform();
       // Create a new unique pointer to QtTrayMenu instance
       state.trayMenu = std::make_unique<QtTrayMenu>();
+      state.trayMenu->setMenuProvider(state.menuProvider.load());
+      QString icon_disk_cache;
+      {
+        std::lock_guard lock(state.settingsMutex);
+        icon_disk_cache = state.iconDiskCache;
+      }
+      state.trayMenu->setIconDiskCache(icon_disk_cache);
+      state.trayMenu->setAsyncIconDecode(state.asyncIconDecode.load());
       tray_qt::apply_app_info(false);
     }
 
+    state.trayMenu->setAsyncIconPreload(state.asyncIconPreload.load());
     if (const auto result = state.trayMenu->init(tray, false); result < 0) {
       // Tray init failed. Clean up and return error.
       tray_exit();
       return result;
     }
+    state.appliedSnapshot.reset();
+    state.trayMenu->setItemOwner(nullptr);
+    // tray_exit() joined the callback workers, so every run of the tray starts its own
+    state.trayMenu->setCallbackThreads(state.callbackThreads.load());
     tray_qt::apply_app_info();
 
     if (!QtTrayMenu::supportsMessages()) {
@@ -183,30 +604,158 @@ extern "C" {
       return;
     }
 
+    if (auto &batch = tray_qt::batch(); batch.depth > 0) {
+      batch.tray = tray;
+      tray_qt::state().updatesBatched++;
+      return;
+    }
+
+    tray_qt::update_blocking(tray);
+  }
+
+  void tray_update_async(struct tray *tray, void (*completion)(struct tray *tray, void *context), void *context) {  // NOSONAR(cpp:S995, cpp:S5205): C API requires this exact signature
+    if (tray_qt::state().trayMenu == nullptr || tray == nullptr) {
+      return;
+    }
+
+    // Always queued, so an update requested from a menu callback never releases the items that callback runs on
+    tray_qt::Command command;
+    command.snapshot = tray_qt::make_snapshot(tray);
+    command.tray = command.snapshot->tray;
+    command.completion = {completion, tray, context};
+    tray_qt::post_command(std::move(command));
+  }
+
+  void tray_menu_item_update(struct tray_menu *item) {  // NOSONAR(cpp:S995): C API requires this exact mutable-pointer signature
+    if (tray_qt::state().trayMenu == nullptr || item == nullptr) {
+      return;
+    }
+
+    if (auto &batch = tray_qt::batch(); batch.depth > 0) {
+      if (std::find(batch.items.begin(), batch.items.end(), item) == batch.items.end()) {
+        batch.items.push_back(item);
+      }
+      tray_qt::state().updatesBatched++;
+      return;
+    }
+
+    tray_qt::Command command;
+    command.item = item;
+    tray_qt::run_command(std::move(command));
+  }
+
+  int tray_set_icon_data(const struct tray_icon_data *icon) {
+    if (tray_qt::state().trayMenu == nullptr) {
+      return -1;
+    }
+
+    auto *const tray_menu = tray_qt::state().trayMenu.get();
+    int result = -1;
+    tray_qt::run_blocking([tray_menu, icon, &result]() {
+      result = tray_menu->setIconData(icon);
+    });
+    return result;
+  }
+
+  int tray_set_icon_animation(const char *const *paths, int count, int fps) {
+    if (tray_qt::state().trayMenu == nullptr) {
+      return -1;
+    }
+
+    auto *const tray_menu = tray_qt::state().trayMenu.get();
+    int result = -1;
+    tray_qt::run_blocking([tray_menu, paths, count, fps, &result]() {
+      result = tray_menu->startIconAnimation(paths, count, fps);
+    });
+    return result;
+  }
+
+  int tray_set_icon_animation_data(const struct tray_icon_data *frames, int count, int fps) {
+    if (tray_qt::state().trayMenu == nullptr) {
+      return -1;
+    }
+
+    auto *const tray_menu = tray_qt::state().trayMenu.get();
+    int result = -1;
+    tray_qt::run_blocking([tray_menu, frames, count, fps, &result]() {
+      result = tray_menu->startIconAnimation(frames, count, fps);
+    });
+    return result;
+  }
+
+  void tray_stop_icon_animation(void) {
+    if (tray_qt::state().trayMenu == nullptr) {
+      return;
+    }
+
     auto *const tray_menu = tray_qt::state().trayMenu.get();
-    const auto apply_update = [tray_menu, tray]() {
-      tray_menu->update(tray, false);
-      tray_qt::notify(tray);
-    };
+    tray_qt::run_async([tray_menu]() {
+      tray_menu->stopIconAnimation();
+    });
+  }
 
-    if (QThread::currentThread() == tray_menu->thread()) {
-      apply_update();
+  void tray_set_badge(int count) {
+    if (count <= 0) {
+      tray_set_badge_text(nullptr);
+    } else {
+      tray_set_badge_text(count > 99 ? "99+" : QByteArray::number(count).constData());
+    }
+  }
+
+  void tray_set_badge_text(const char *text) {
+    if (tray_qt::state().trayMenu == nullptr) {
       return;
     }
 
-    // Keep the C API synchronous so callers can safely reuse or release tray data after this function returns.
-    (void) QMetaObject::invokeMethod(tray_menu, apply_update, Qt::BlockingQueuedConnection);
+    auto *const tray_menu = tray_qt::state().trayMenu.get();
+    const QString badge = text != nullptr ? QString::fromUtf8(text) : QString();
+    tray_qt::run_async([tray_menu, badge]() {
+      tray_menu->setBadge(badge);
+    });
+  }
+
+  void tray_update_begin(void) {
+    tray_qt::batch().depth++;
+  }
+
+  void tray_update_commit(void) {
+    auto &batch = tray_qt::batch();
+    if (batch.depth == 0 || --batch.depth > 0) {
+      return;
+    }
+    struct tray *tray = batch.tray;
+    const std::vector<struct tray_menu *> items = std::move(batch.items);
+    batch.tray = nullptr;
+    batch.items.clear();
+    if (tray_qt::state().trayMenu == nullptr || (tray == nullptr && items.empty())) {
+      return;
+    }
+
+    if (tray != nullptr) {
+      // A full update reconciles the menu, which already picks up every recorded item change
+      tray_qt::update_blocking(tray);
+      return;
+    }
+    auto *const tray_menu = tray_qt::state().trayMenu.get();
+    tray_qt::run_blocking([tray_menu, &items]() {
+      for (const struct tray_menu *item : items) {
+        tray_menu->updateMenuItem(item);
+      }
+    });
   }
 
   void tray_exit(void) {
     if (tray_qt::state().trayMenu == nullptr) {
       return;
     }
-    tray_qt::state().trayMenu->exit();
+    auto *const tray_menu = tray_qt::state().trayMenu.get();
+    tray_qt::run_async([tray_menu]() {
+      tray_menu->exit();
+    });
   }
 
   void tray_set_log_callback(void (*cb)(int level, const char *msg)) {  // NOSONAR(cpp:S5205): C API requires a plain function pointer callback type
-    tray_qt::state().logCallback = cb;
+    tray_qt::state().logCallback.store(cb);
     if (cb != nullptr) {
       qInstallMessageHandler(tray_qt::qt_message_handler);
     } else {
@@ -214,36 +763,209 @@ extern "C" {
     }
   }
 
+  void tray_set_async_icon_preload(int enabled) {
+    tray_qt::state().asyncIconPreload = enabled != 0;
+  }
+
+  void tray_set_async_icon_decode(int enabled) {
+    auto &state = tray_qt::state();
+    const bool async = enabled != 0;
+    state.asyncIconDecode = async;
+    if (state.trayMenu != nullptr) {
+      auto *const tray_menu = state.trayMenu.get();
+      tray_qt::run_async([tray_menu, async]() {
+        tray_menu->setAsyncIconDecode(async);
+      });
+    }
+  }
+
+  int tray_set_callback_threads(int count) {
+    if (count < 0) {
+      return -1;
+    }
+
+    auto &state = tray_qt::state();
+    state.callbackThreads = count;
+    if (state.trayMenu != nullptr) {
+      auto *const tray_menu = state.trayMenu.get();
+      tray_qt::run_async([tray_menu, count]() {
+        tray_menu->setCallbackThreads(count);
+      });
+    }
+    return 0;
+  }
+
+  int tray_set_icon_disk_cache(const char *directory) {
+    QString path;
+    if (directory != nullptr) {
+      if (directory[0] != '\0') {
+        path = QString::fromUtf8(directory);
+      } else if (const QString cache = QStandardPaths::writableLocation(QStandardPaths::GenericCacheLocation); !cache.isEmpty()) {
+        path = cache + QStringLiteral("/tray");
+      }
+      if (path.isEmpty() || !QDir().mkpath(path)) {
+        return -1;
+      }
+    }
+
+    auto &state = tray_qt::state();
+    {
+      std::lock_guard lock(state.settingsMutex);
+      state.iconDiskCache = path;
+    }
+    if (state.trayMenu != nullptr) {
+      auto *const tray_menu = state.trayMenu.get();
+      tray_qt::run_async([tray_menu, path]() {
+        tray_menu->setIconDiskCache(path);
+      });
+    }
+    return 0;
+  }
+
+  void tray_set_menu_provider(void (*provider)(struct tray *tray, struct tray_menu *parent)) {  // NOSONAR(cpp:S5205): C API requires a plain function pointer callback type
+    auto &state = tray_qt::state();
+    state.menuProvider = provider;
+    if (state.trayMenu != nullptr) {
+      auto *const tray_menu = state.trayMenu.get();
+      tray_qt::run_async([tray_menu, provider]() {
+        tray_menu->setMenuProvider(provider);
+      });
+    }
+  }
+
   void tray_show_menu(void) {
     if (tray_qt::state().trayMenu == nullptr) {
       return;
     }
-    tray_qt::state().trayMenu->showMenu();
+    auto *const tray_menu = tray_qt::state().trayMenu.get();
+    tray_qt::run_async([tray_menu]() {
+      tray_menu->showMenu();
+    });
   }
 
   int tray_position_mouse_over_icon(void) {
     if (tray_qt::state().trayMenu == nullptr) {
       return -1;
     }
-    return tray_qt::state().trayMenu->positionMouseOverIcon() ? 0 : -1;
+    auto *const tray_menu = tray_qt::state().trayMenu.get();
+    bool positioned = false;
+    tray_qt::run_blocking([tray_menu, &positioned]() {
+      positioned = tray_menu->positionMouseOverIcon();
+    });
+    return positioned ? 0 : -1;
   }
 
   int tray_restore_mouse_position(void) {
     if (tray_qt::state().trayMenu == nullptr) {
       return -1;
     }
-    return tray_qt::state().trayMenu->restoreMousePosition() ? 0 : -1;
+    auto *const tray_menu = tray_qt::state().trayMenu.get();
+    bool restored = false;
+    tray_qt::run_blocking([tray_menu, &restored]() {
+      restored = tray_menu->restoreMousePosition();
+    });
+    return restored ? 0 : -1;
   }
 
   void tray_simulate_menu_item_click(int index) {
     if (tray_qt::state().trayMenu == nullptr) {
       return;
     }
-    tray_qt::state().trayMenu->clickMenuItem(index);
+    auto *const tray_menu = tray_qt::state().trayMenu.get();
+    tray_qt::run_async([tray_menu, index]() {
+      tray_menu->clickMenuItem(index);
+    });
+  }
+
+  void tray_simulate_submenu_open(int index) {
+    if (tray_qt::state().trayMenu == nullptr) {
+      return;
+    }
+    auto *const tray_menu = tray_qt::state().trayMenu.get();
+    tray_qt::run_async([tray_menu, index]() {
+      tray_menu->openSubmenu(index);
+    });
+  }
+
+  int tray_get_icon_sizes(int *sizes, int count) {
+    if (tray_qt::state().trayMenu == nullptr) {
+      return -1;
+    }
+    auto *const tray_menu = tray_qt::state().trayMenu.get();
+    int available = -1;
+    tray_qt::run_blocking([tray_menu, sizes, count, &available]() {
+      const QIcon icon = tray_menu->icon();
+      if (icon.isNull()) {
+        return;
+      }
+      const auto iconSizes = icon.availableSizes();
+      available = static_cast<int>(iconSizes.size());
+      for (int i = 0; sizes != nullptr && i < count && i < available; i++) {
+        sizes[i] = iconSizes[i].width();
+      }
+    });
+    return available;
+  }
+
+  int tray_get_icon_pixmap(int size, double ratio, int *width, double *pixel_ratio) {
+    if (tray_qt::state().trayMenu == nullptr) {
+      return -1;
+    }
+    auto *const tray_menu = tray_qt::state().trayMenu.get();
+    int result = -1;
+    tray_qt::run_blocking([tray_menu, size, ratio, width, pixel_ratio, &result]() {
+      const QIcon icon = tray_menu->icon();
+      if (icon.isNull()) {
+        return;
+      }
+#if QT_VERSION >= QT_VERSION_CHECK(6, 0, 0)
+      const QPixmap pixmap = icon.pixmap(QSize(size, size), ratio);
+#else
+      // Qt 5 only draws for the ratio of the application
+      if (!qFuzzyCompare(ratio, qGuiApp->devicePixelRatio())) {
+        return;
+      }
+      const QPixmap pixmap = icon.pixmap(QSize(size, size));
+#endif
+      if (width != nullptr) {
+        *width = pixmap.width();
+      }
+      if (pixel_ratio != nullptr) {
+        *pixel_ratio = pixmap.devicePixelRatio();
+      }
+      result = 0;
+    });
+    return result;
   }
 
   void tray_simulate_notification_click(void) {
-    tray_qt::acknowledge_notification();
+    if (tray_qt::state().trayMenu == nullptr) {
+      return;
+    }
+    tray_qt::run_async([]() {
+      tray_qt::acknowledge_notification();
+    });
+  }
+
+  void tray_get_stats(struct tray_stats *stats) {
+    if (stats == nullptr) {
+      return;
+    }
+    if (tray_qt::state().trayMenu == nullptr) {
+      *stats = {};
+      return;
+    }
+    // Menu counters are only written on the UI thread, so they are read there too
+    auto *const tray_menu = tray_qt::state().trayMenu.get();
+    tray_qt::run_blocking([tray_menu, stats]() {
+      *stats = tray_menu->stats();
+    });
+    stats->updates_batched = tray_qt::state().updatesBatched.load();
+    stats->updates_coalesced = tray_qt::state().updatesCoalesced.load();
+    stats->commands_queued = tray_qt::state().commandsQueued.load();
+    stats->command_wakeups = tray_qt::state().commandWakeups.load();
+    stats->command_queue_full = tray_qt::state().commandQueueFull.load();
+    stats->command_batch_peak = tray_qt::state().commandBatchPeak.load();
   }
 
 }  // extern "C"
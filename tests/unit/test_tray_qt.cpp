@@ -6,16 +6,25 @@
 #include "src/tray.h"
 
 // standard includes
+#include <algorithm>
 #include <array>
 #include <atomic>
 #include <chrono>
 #include <cstddef>
 #include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <limits>
 #include <new>
 #include <optional>
 #include <thread>
 #include <vector>
 
+#if defined(__linux__) || defined(__APPLE__)
+  // qt includes
+  #include <QImage>
+  #include <QString>
+#endif
 #if defined(_WIN32)
   // local includes
   #include "src/WindowsAppearance.h"
@@ -45,9 +54,58 @@ namespace {
     notification_callback_count()++;
   }
 
+  std::atomic<int> &worker_callback_count() {
+    static std::atomic<int> count {0};
+    return count;
+  }
+
+  std::atomic<bool> &worker_callback_off_main_thread() {
+    static std::atomic<bool> offMainThread {false};
+    return offMainThread;
+  }
+
+  std::thread::id &main_thread_id() {
+    static std::thread::id id;
+    return id;
+  }
+
+  void worker_menu_item_cb([[maybe_unused]] struct tray_menu *item) {
+    if (std::this_thread::get_id() != main_thread_id()) {
+      worker_callback_off_main_thread().store(true);
+    }
+    worker_callback_count()++;
+  }
+
   void log_cb([[maybe_unused]] int level, [[maybe_unused]] const char *msg) {
     log_callback_count()++;
   }
+
+  struct tray_menu *&provided_parent() {
+    static struct tray_menu *parent = nullptr;
+    return parent;
+  }
+
+  void menu_provider([[maybe_unused]] struct tray *tray, struct tray_menu *parent) {
+    provided_parent() = parent;
+    if (parent != nullptr && parent->submenu != nullptr) {
+      parent->submenu[0].text = "Provided";
+    }
+  }
+
+  int &source_item_count() {
+    static int count = 0;
+    return count;
+  }
+
+  int source_count([[maybe_unused]] struct tray_menu_source *source) {
+    return 250;
+  }
+
+  void source_get_item([[maybe_unused]] struct tray_menu_source *source, [[maybe_unused]] int index, struct tray_menu *item) {
+    source_item_count()++;
+    item->text = "Source item";
+    item->cb = menu_item_cb;
+  }
 }  // namespace
 
 class TrayQtCoverageTest: public BaseTest {
@@ -102,6 +160,11 @@ protected:
 
     tray_restore_mouse_position();
     tray_set_log_callback(nullptr);
+    tray_set_menu_provider(nullptr);
+    tray_set_async_icon_preload(0);
+    tray_set_icon_disk_cache(nullptr);
+    tray_set_async_icon_decode(0);
+    tray_set_callback_threads(0);
     BaseTest::TearDown();
   }
 
@@ -116,6 +179,25 @@ protected:
       tray_loop(0);
     }
   }
+
+  struct tray *MakeIconPathTray(std::vector<std::byte> &buf, const std::vector<const char *> &iconPaths) {
+    buf.assign(sizeof(struct tray) + iconPaths.size() * sizeof(const char *), std::byte {0});
+    auto *iconPathTray = ::new (static_cast<void *>(buf.data())) tray {
+      .icon = "icon.png",
+      .tooltip = "Icon preload",
+      .notification_icon = nullptr,
+      .notification_text = nullptr,
+      .notification_title = nullptr,
+      .notification_cb = nullptr,
+      .cb = nullptr,
+      .menu = menuItems.data(),
+      .iconPathCount = static_cast<int>(iconPaths.size()),
+    };
+    for (size_t i = 0; i < iconPaths.size(); i++) {
+      iconPathTray->allIconPaths[i] = iconPaths[i];
+    }
+    return iconPathTray;
+  }
 };
 
 #if defined(_WIN32)
@@ -166,6 +248,7 @@ TEST_F(TrayQtCoverageTest, ApiCallsAreNoOpsBeforeInit) {
   tray_show_menu();
   EXPECT_EQ(tray_position_mouse_over_icon(), -1);
   EXPECT_EQ(tray_restore_mouse_position(), -1);
+  EXPECT_EQ(tray_set_icon_data(nullptr), -1);
   tray_simulate_menu_item_click(0);
   tray_simulate_notification_click();
   PumpEvents();
@@ -209,6 +292,234 @@ TEST_F(TrayQtCoverageTest, UpdateFromWorkerThreadWaitsForApplicationThread) {
   EXPECT_EQ(menu_callback_count(), 1);
 }
 
+TEST_F(TrayQtCoverageTest, AsyncUpdateFromWorkerThreadAppliesOwnedSnapshot) {
+  tray_update_async(trayData, nullptr, nullptr);
+  InitTray();
+
+  std::array<struct tray_menu, 2> workerSubmenu = {{{.text = "Worker nested", .cb = menu_item_cb}, {.text = nullptr}}};
+  std::array<struct tray_menu, 3> workerMenu = {{{.text = "Worker item", .cb = menu_item_cb}, {.text = "Worker submenu", .submenu = workerSubmenu.data()}, {.text = nullptr}}};
+  trayData->menu = workerMenu.data();
+
+  static std::atomic<int> completions {0};
+  completions.store(0);
+  std::thread worker([this, &workerMenu]() {
+    tray_update_async(
+      trayData,
+      [](struct tray *, void *) {
+        completions++;
+      },
+      nullptr
+    );
+    // The snapshot is already taken, so the caller's items can change right away
+    workerMenu[0].cb = nullptr;
+  });
+  worker.join();
+  EXPECT_EQ(completions.load(), 0);
+
+  const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+  while (completions.load() == 0 && std::chrono::steady_clock::now() < deadline) {
+    PumpEvents(1);
+  }
+  EXPECT_EQ(completions.load(), 1);
+
+  tray_simulate_submenu_open(1);
+  tray_simulate_menu_item_click(0);
+  PumpEvents();
+  EXPECT_EQ(menu_callback_count(), 1);
+
+  // A synchronous update switches back to the caller's own items
+  trayData->menu = menuItems.data();
+  tray_update(trayData);
+  tray_simulate_menu_item_click(0);
+  PumpEvents();
+  EXPECT_EQ(menu_callback_count(), 2);
+}
+
+TEST_F(TrayQtCoverageTest, QueuedUpdatesAreCoalesced) {
+  InitTray();
+
+  constexpr int updates = 10;
+  std::array<struct tray_menu, 2> staleMenu = {{{.text = "Stale"}, {.text = nullptr}}};
+  std::array<struct tray_menu, 2> newestMenu = {{{.text = "Newest", .cb = menu_item_cb}, {.text = nullptr}}};
+
+  static std::atomic<int> completions {0};
+  completions.store(0);
+  const auto count_completion = [](struct tray *, void *) {
+    completions++;
+  };
+
+  struct tray_stats before {};
+  tray_get_stats(&before);
+  trayData->menu = staleMenu.data();
+  for (int i = 0; i < updates - 1; i++) {
+    tray_update_async(trayData, count_completion, nullptr);
+  }
+  trayData->menu = newestMenu.data();
+  tray_update_async(trayData, count_completion, nullptr);
+
+  PumpEvents();
+  EXPECT_EQ(completions.load(), updates);
+
+  struct tray_stats after {};
+  tray_get_stats(&after);
+  EXPECT_EQ(after.updates_coalesced - before.updates_coalesced, static_cast<unsigned long long>(updates - 1));
+
+  tray_simulate_menu_item_click(0);
+  PumpEvents();
+  EXPECT_EQ(menu_callback_count(), 1);
+
+  // An update from a worker thread still waits until it is shown
+  trayData->menu = menuItems.data();
+  std::atomic updateReturned {false};
+  std::thread worker([this, &updateReturned]() {
+    tray_update(trayData);
+    updateReturned.store(true);
+  });
+  while (!updateReturned.load()) {
+    PumpEvents(1);
+  }
+  worker.join();
+  tray_simulate_menu_item_click(0);
+  PumpEvents();
+  EXPECT_EQ(menu_callback_count(), 2);
+}
+
+TEST_F(TrayQtCoverageTest, QueuedCommandsShareOneWakeup) {
+  InitTray();
+  PumpEvents();
+
+  static std::atomic<int> completions {0};
+  completions.store(0);
+  const auto count_completion = [](struct tray *, void *) {
+    completions++;
+  };
+
+  constexpr int producers = 4;
+  constexpr int updatesPerProducer = 50;
+  struct tray_stats before {};
+  tray_get_stats(&before);
+  std::vector<std::thread> workers;
+  for (int i = 0; i < producers; i++) {
+    workers.emplace_back([this, count_completion]() {
+      for (int update = 0; update < updatesPerProducer; update++) {
+        tray_update_async(trayData, count_completion, nullptr);
+      }
+    });
+  }
+  for (auto &worker : workers) {
+    worker.join();
+  }
+  PumpEvents();
+  EXPECT_EQ(completions.load(), producers * updatesPerProducer);
+
+  struct tray_stats after {};
+  tray_get_stats(&after);
+  EXPECT_EQ(after.commands_queued - before.commands_queued, static_cast<unsigned long long>(producers * updatesPerProducer));
+  EXPECT_EQ(after.command_wakeups - before.command_wakeups, 1U);
+  EXPECT_GE(after.command_batch_peak, static_cast<unsigned long long>(producers * updatesPerProducer));
+  EXPECT_EQ(after.command_queue_full, before.command_queue_full);
+
+  // More updates than the queue holds, the rest is coalesced without waiting and still completed
+  completions.store(0);
+  tray_get_stats(&before);
+  for (int update = 0; update < 300; update++) {
+    tray_update_async(trayData, count_completion, nullptr);
+  }
+  tray_get_stats(&after);
+  EXPECT_EQ(after.command_queue_full - before.command_queue_full, 44U);
+  EXPECT_EQ(after.commands_queued - before.commands_queued, 300U);
+  EXPECT_EQ(after.command_wakeups - before.command_wakeups, 1U);
+  EXPECT_EQ(completions.load(), 0);
+  PumpEvents();
+  EXPECT_EQ(completions.load(), 300);
+  tray_get_stats(&after);
+  EXPECT_EQ(after.updates_coalesced - before.updates_coalesced, 299U);
+}
+
+TEST_F(TrayQtCoverageTest, ApiCallsFromWorkerThreadAreMarshalled) {
+  InitTray();
+
+  std::atomic workerDone {false};
+  std::thread worker([&workerDone]() {
+    tray_set_log_callback(log_cb);
+    tray_simulate_menu_item_click(0);
+    struct tray_stats stats {};
+    tray_get_stats(&stats);
+    tray_set_app_info("TrayWorker", "Tray Worker", nullptr);
+    tray_exit();
+    workerDone.store(true);
+  });
+  while (!workerDone.load()) {
+    PumpEvents(1);
+  }
+  worker.join();
+  PumpEvents();
+
+  EXPECT_EQ(menu_callback_count(), 1);
+  EXPECT_EQ(tray_loop(0), -1);
+  trayRunning = false;
+}
+
+TEST_F(TrayQtCoverageTest, CallbacksCanRunOnWorkerThreads) {
+  EXPECT_EQ(tray_set_callback_threads(-1), -1);
+  ASSERT_EQ(tray_set_callback_threads(2), 0);
+  menuItems[0].cb = worker_menu_item_cb;
+  InitTray();
+
+  main_thread_id() = std::this_thread::get_id();
+  worker_callback_count().store(0);
+  worker_callback_off_main_thread().store(false);
+  struct tray_stats before {};
+  tray_get_stats(&before);
+
+  tray_simulate_menu_item_click(0);
+  tray_simulate_menu_item_click(0);
+  const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+  while (worker_callback_count().load() < 2 && std::chrono::steady_clock::now() < deadline) {
+    PumpEvents(1);
+  }
+  EXPECT_EQ(worker_callback_count().load(), 2);
+  EXPECT_TRUE(worker_callback_off_main_thread().load());
+
+  struct tray_stats after {};
+  tray_get_stats(&after);
+  EXPECT_EQ(after.callbacks_offloaded - before.callbacks_offloaded, 2U);
+
+  // Back on the application thread
+  ASSERT_EQ(tray_set_callback_threads(0), 0);
+  tray_simulate_menu_item_click(0);
+  EXPECT_EQ(worker_callback_count().load(), 3);
+}
+
+TEST_F(TrayQtCoverageTest, ExitWaitsForCallbacksOnWorkerThreads) {
+  static std::atomic<bool> finished {false};
+  finished.store(false);
+  ASSERT_EQ(tray_set_callback_threads(1), 0);
+  menuItems[0].cb = [](struct tray_menu *) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    finished.store(true);
+  };
+  InitTray();
+
+  tray_simulate_menu_item_click(0);
+  tray_exit();
+  EXPECT_TRUE(finished.load());
+  EXPECT_EQ(tray_loop(0), -1);
+  trayRunning = false;
+
+  // The next run starts new workers
+  finished.store(false);
+  InitTray();
+  tray_simulate_menu_item_click(0);
+  struct tray_stats stats {};
+  tray_get_stats(&stats);
+  EXPECT_GT(stats.callbacks_offloaded, 0U);
+  tray_exit();
+  EXPECT_TRUE(finished.load());
+  EXPECT_EQ(tray_loop(0), -1);
+  trayRunning = false;
+}
+
 TEST_F(TrayQtCoverageTest, SimulateMenuClickWithNullMenuDoesNothing) {
   trayData->menu = nullptr;
   InitTray();
@@ -373,3 +684,711 @@ TEST_F(TrayQtCoverageTest, ClearingNotificationDisablesSimulatedClickCallback) {
 
   waitForNativeNotificationTimeout();
 }
+
+TEST_F(TrayQtCoverageTest, UpdateMenuReusesExistingActions) {
+  InitTray();
+
+  struct tray_stats before {};
+  tray_get_stats(&before);
+  EXPECT_GT(before.menu_actions_created, 0U);
+
+  menuItems[0].checkbox = 1;
+  menuItems[0].checked = 1;
+  tray_update(trayData);
+  PumpEvents();
+
+  struct tray_stats after {};
+  tray_get_stats(&after);
+  EXPECT_EQ(after.menu_actions_created, before.menu_actions_created);
+  EXPECT_EQ(after.menu_actions_reused - before.menu_actions_reused, 5U);
+
+  tray_simulate_menu_item_click(0);
+  PumpEvents();
+  EXPECT_EQ(menu_callback_count(), 1);
+}
+
+TEST_F(TrayQtCoverageTest, UpdateMenuWithChangedLayoutCreatesOnlyNewActions) {
+  InitTray();
+
+  std::array<struct tray_menu, 4> shorterMenu = {{{.text = "Clickable", .cb = menu_item_cb}, {.text = "Extra", .cb = menu_item_cb}, {.text = "-"}, {.text = nullptr}}};
+  trayData->menu = shorterMenu.data();
+
+  struct tray_stats before {};
+  tray_get_stats(&before);
+  tray_update(trayData);
+  PumpEvents();
+
+  struct tray_stats after {};
+  tray_get_stats(&after);
+  // "Clickable" and the separator are reused, "Extra" is inserted before the separator
+  EXPECT_EQ(after.menu_actions_reused - before.menu_actions_reused, 2U);
+  EXPECT_EQ(after.menu_actions_created - before.menu_actions_created, 1U);
+
+  tray_simulate_menu_item_click(1);
+  PumpEvents();
+  EXPECT_EQ(menu_callback_count(), 1);
+}
+
+TEST_F(TrayQtCoverageTest, MenuItemUpdateAppliesSingleItemState) {
+  InitTray();
+
+  struct tray_stats before {};
+  tray_get_stats(&before);
+
+  menuItems[0].disabled = 1;
+  tray_menu_item_update(&menuItems[0]);
+  PumpEvents();
+
+  tray_simulate_menu_item_click(0);
+  PumpEvents();
+  EXPECT_EQ(menu_callback_count(), 0);
+
+  menuItems[0].disabled = 0;
+  tray_menu_item_update(&menuItems[0]);
+  PumpEvents();
+
+  tray_simulate_menu_item_click(0);
+  PumpEvents();
+  EXPECT_EQ(menu_callback_count(), 1);
+
+  // Single item updates never walk the menu
+  struct tray_stats after {};
+  tray_get_stats(&after);
+  EXPECT_EQ(after.menu_actions_reused, before.menu_actions_reused);
+  EXPECT_EQ(after.menu_actions_created, before.menu_actions_created);
+
+  // Unknown items are ignored
+  struct tray_menu unknown = {.text = "Unknown", .cb = menu_item_cb};
+  tray_menu_item_update(&unknown);
+  tray_menu_item_update(nullptr);
+}
+
+TEST_F(TrayQtCoverageTest, FullUpdateRevertsSingleItemUpdate) {
+  InitTray();
+
+  menuItems[0].disabled = 1;
+  tray_menu_item_update(&menuItems[0]);
+  PumpEvents();
+
+  // Back to the state the level was last built from, which must not be mistaken for no change
+  menuItems[0].disabled = 0;
+  tray_update(trayData);
+  PumpEvents();
+
+  tray_simulate_menu_item_click(0);
+  PumpEvents();
+  EXPECT_EQ(menu_callback_count(), 1);
+}
+
+TEST_F(TrayQtCoverageTest, SubmenusAreNotBuiltUntilShown) {
+  struct tray_stats before {};
+  tray_get_stats(&before);
+  InitTray();
+
+  struct tray_stats after {};
+  tray_get_stats(&after);
+  // Only the five top-level entries exist, the nested item is built on demand
+  EXPECT_EQ(after.menu_actions_created - before.menu_actions_created, 5U);
+  EXPECT_EQ(after.menus_materialized - before.menus_materialized, 1U);
+
+  submenuItems[0].text = "Nested Renamed";
+  tray_update(trayData);
+  PumpEvents();
+
+  tray_get_stats(&after);
+  EXPECT_EQ(after.menu_actions_created - before.menu_actions_created, 5U);
+  EXPECT_EQ(after.menus_materialized - before.menus_materialized, 1U);
+}
+
+TEST_F(TrayQtCoverageTest, UnchangedUpdateSkipsMenuIconAndTooltip) {
+  InitTray();
+
+  struct tray_stats before {};
+  tray_get_stats(&before);
+  tray_update(trayData);
+  PumpEvents();
+
+  struct tray_stats after {};
+  tray_get_stats(&after);
+  EXPECT_EQ(after.menus_skipped - before.menus_skipped, 1U);
+  EXPECT_EQ(after.menus_materialized, before.menus_materialized);
+  EXPECT_EQ(after.icon_updates_skipped - before.icon_updates_skipped, 1U);
+  EXPECT_EQ(after.tooltip_updates_skipped - before.tooltip_updates_skipped, 1U);
+  EXPECT_EQ(after.menu_actions_reused, before.menu_actions_reused);
+
+  trayData->tooltip = "Changed tooltip";
+  menuItems[4].checkbox = 1;
+  tray_update(trayData);
+  PumpEvents();
+
+  tray_get_stats(&after);
+  EXPECT_EQ(after.menus_materialized - before.menus_materialized, 1U);
+  EXPECT_EQ(after.icon_updates_skipped - before.icon_updates_skipped, 2U);
+  EXPECT_EQ(after.tooltip_updates_applied - before.tooltip_updates_applied, 1U);
+}
+
+TEST_F(TrayQtCoverageTest, IconFileRewrittenInPlaceIsShownAgain) {
+  const auto iconPath = std::filesystem::temp_directory_path() / "tray-test-rewritten-icon.png";
+  std::filesystem::copy_file("icon.png", iconPath, std::filesystem::copy_options::overwrite_existing);
+  const std::string icon = iconPath.string();
+  trayData->icon = icon.c_str();
+  InitTray();
+
+  struct tray_stats before {};
+  tray_get_stats(&before);
+  tray_update(trayData);
+  PumpEvents();
+
+  // Same path, different pixels
+  std::filesystem::copy_file("icon2.png", iconPath, std::filesystem::copy_options::overwrite_existing);
+  std::filesystem::last_write_time(iconPath, std::filesystem::last_write_time(iconPath) + std::chrono::seconds(2));
+  tray_update(trayData);
+  PumpEvents();
+
+  struct tray_stats after {};
+  tray_get_stats(&after);
+  EXPECT_EQ(after.icon_updates_skipped - before.icon_updates_skipped, 1U);
+  EXPECT_EQ(after.icon_updates_applied - before.icon_updates_applied, 1U);
+
+  tray_exit();
+  tray_loop(0);
+  trayRunning = false;
+  std::filesystem::remove(iconPath);
+}
+
+TEST_F(TrayQtCoverageTest, RemovedActionsAreRecycledByLaterUpdates) {
+  InitTray();
+
+  std::array<struct tray_menu, 2> shortMenu = {{{.text = "Clickable", .cb = menu_item_cb}, {.text = nullptr}}};
+  trayData->menu = shortMenu.data();
+  tray_update(trayData);
+  PumpEvents();
+
+  struct tray_stats before {};
+  tray_get_stats(&before);
+
+  // Growing back to the original layout must not allocate any new actions or submenus
+  trayData->menu = menuItems.data();
+  tray_update(trayData);
+  PumpEvents();
+
+  struct tray_stats after {};
+  tray_get_stats(&after);
+  EXPECT_EQ(after.menu_actions_created, before.menu_actions_created);
+  EXPECT_EQ(after.menus_created, before.menus_created);
+  EXPECT_EQ(after.menu_actions_recycled - before.menu_actions_recycled, 4U);
+  EXPECT_EQ(after.menus_recycled - before.menus_recycled, 1U);
+
+  tray_simulate_menu_item_click(4);
+  PumpEvents();
+  EXPECT_EQ(menu_callback_count(), 1);
+}
+
+TEST_F(TrayQtCoverageTest, SourceSubmenuFetchesOnlyTheFirstPageWhenOpened) {
+  source_item_count() = 0;
+  struct tray_menu_source source = {.count = source_count, .get_item = source_get_item, .context = nullptr, .page_size = 100};
+  menuItems[2].submenu = nullptr;
+  menuItems[2].source = &source;
+  InitTray();
+
+  EXPECT_EQ(source_item_count(), 0);
+
+  tray_simulate_submenu_open(2);
+  PumpEvents();
+  EXPECT_EQ(source_item_count(), 100);
+
+  // Reopening an unchanged page refetches it but does not rebuild the menu
+  struct tray_stats before {};
+  tray_get_stats(&before);
+  tray_update(trayData);
+  tray_simulate_submenu_open(2);
+  PumpEvents();
+
+  struct tray_stats after {};
+  tray_get_stats(&after);
+  EXPECT_EQ(source_item_count(), 200);
+  EXPECT_EQ(after.menus_materialized, before.menus_materialized);
+  EXPECT_EQ(after.menu_actions_created, before.menu_actions_created);
+
+  // The source is asked again on every show, even without a tray update in between
+  tray_simulate_submenu_open(2);
+  PumpEvents();
+  tray_get_stats(&after);
+  EXPECT_EQ(source_item_count(), 300);
+  EXPECT_EQ(after.menus_materialized, before.menus_materialized);
+}
+
+TEST_F(TrayQtCoverageTest, ItemsWithIdsKeepTheirActionsAcrossReorders) {
+  static int firstCount = 0;
+  static int secondCount = 0;
+  firstCount = 0;
+  secondCount = 0;
+  auto first_cb = [](struct tray_menu *) {
+    firstCount++;
+  };
+  auto second_cb = [](struct tray_menu *) {
+    secondCount++;
+  };
+
+  std::array<struct tray_menu, 4> orderedMenu = {{{.text = "First", .cb = first_cb, .id = 1}, {.text = "Second", .cb = second_cb, .id = 2}, {.text = "Third", .cb = menu_item_cb, .id = 3}, {.text = nullptr}}};
+  trayData->menu = orderedMenu.data();
+  InitTray();
+
+  struct tray_stats before {};
+  tray_get_stats(&before);
+
+  std::array<struct tray_menu, 4> reorderedMenu = {{{.text = "Third", .cb = menu_item_cb, .id = 3}, {.text = "First", .cb = first_cb, .id = 1}, {.text = "Second", .cb = second_cb, .id = 2}, {.text = nullptr}}};
+  trayData->menu = reorderedMenu.data();
+  tray_update(trayData);
+  PumpEvents();
+
+  struct tray_stats after {};
+  tray_get_stats(&after);
+  EXPECT_EQ(after.menu_actions_created, before.menu_actions_created);
+  EXPECT_EQ(after.menu_actions_recycled, before.menu_actions_recycled);
+  EXPECT_EQ(after.menu_actions_reused - before.menu_actions_reused, 3U);
+
+  tray_simulate_menu_item_click(0);
+  tray_simulate_menu_item_click(2);
+  PumpEvents();
+  EXPECT_EQ(menu_callback_count(), 1);
+  EXPECT_EQ(firstCount, 0);
+  EXPECT_EQ(secondCount, 1);
+}
+
+TEST_F(TrayQtCoverageTest, MenuProviderFillsSubmenuBeforeItIsShown) {
+  provided_parent() = nullptr;
+  tray_set_menu_provider(menu_provider);
+  InitTray();
+
+  struct tray_stats before {};
+  tray_get_stats(&before);
+
+  tray_simulate_submenu_open(2);
+  PumpEvents();
+
+  struct tray_stats after {};
+  tray_get_stats(&after);
+  EXPECT_EQ(provided_parent(), &menuItems[2]);
+  EXPECT_STREQ(submenuItems[0].text, "Provided");
+  EXPECT_EQ(after.menu_provider_calls - before.menu_provider_calls, 1U);
+  EXPECT_EQ(after.menus_materialized - before.menus_materialized, 1U);
+}
+
+TEST_F(TrayQtCoverageTest, BatchedUpdatesAreAppliedOnceOnCommit) {
+  InitTray();
+
+  struct tray_stats before {};
+  tray_get_stats(&before);
+
+  tray_update_begin();
+  trayData->tooltip = "First batched tooltip";
+  tray_update(trayData);
+  menuItems[0].disabled = 1;
+  tray_menu_item_update(&menuItems[0]);
+  trayData->tooltip = "Second batched tooltip";
+  tray_update(trayData);
+
+  struct tray_stats pending {};
+  tray_get_stats(&pending);
+  EXPECT_EQ(pending.tooltip_updates_applied, before.tooltip_updates_applied);
+  EXPECT_EQ(pending.updates_batched - before.updates_batched, 3U);
+
+  tray_update_commit();
+  PumpEvents();
+
+  struct tray_stats after {};
+  tray_get_stats(&after);
+  EXPECT_EQ(after.tooltip_updates_applied - before.tooltip_updates_applied, 1U);
+  EXPECT_EQ(after.menus_materialized - before.menus_materialized, 1U);
+
+  tray_simulate_menu_item_click(0);
+  PumpEvents();
+  EXPECT_EQ(menu_callback_count(), 0);
+}
+
+TEST_F(TrayQtCoverageTest, IconFilesAreDecodedOnceWhileToggling) {
+  // Use a copy nobody loaded before, so only its first use misses no matter which tests ran earlier
+  const auto iconPath = std::filesystem::temp_directory_path() / "tray-test-toggled-icon.png";
+  std::filesystem::copy_file("icon2.png", iconPath, std::filesystem::copy_options::overwrite_existing);
+  std::filesystem::last_write_time(iconPath, std::filesystem::file_time_type::clock::now());
+  const std::string toggled = iconPath.string();
+  InitTray();
+
+  struct tray_stats before {};
+  tray_get_stats(&before);
+  for (const char *icon : {toggled.c_str(), "icon.png", toggled.c_str(), "icon.png"}) {
+    trayData->icon = icon;
+    tray_update(trayData);
+    PumpEvents();
+  }
+
+  struct tray_stats after {};
+  tray_get_stats(&after);
+  EXPECT_EQ(after.icon_updates_applied - before.icon_updates_applied, 4U);
+  EXPECT_EQ(after.icon_cache_misses - before.icon_cache_misses, 1U);
+  EXPECT_EQ(after.icon_cache_hits - before.icon_cache_hits, 3U);
+
+  trayData->icon = "icon.png";
+  tray_exit();
+  tray_loop(0);
+  trayRunning = false;
+  std::filesystem::remove(iconPath);
+}
+
+TEST_F(TrayQtCoverageTest, ListedIconsArePreloadedByInit) {
+  std::vector<std::byte> buf;
+  struct tray *iconPathTray = MakeIconPathTray(buf, {"icon.png", "icon2.png", "missing-icon-name"});
+
+  struct tray_stats before {};
+  tray_get_stats(&before);
+  const int initResult = tray_init(iconPathTray);
+  trayRunning = (initResult == 0);
+  ASSERT_EQ(initResult, 0);
+
+  struct tray_stats initialized {};
+  tray_get_stats(&initialized);
+  EXPECT_EQ(initialized.icons_preloaded - before.icons_preloaded, 2U);
+
+  iconPathTray->icon = "icon2.png";
+  tray_update(iconPathTray);
+  PumpEvents();
+
+  struct tray_stats after {};
+  tray_get_stats(&after);
+  EXPECT_EQ(after.icon_updates_applied - initialized.icon_updates_applied, 1U);
+  EXPECT_EQ(after.icon_cache_misses, initialized.icon_cache_misses);
+}
+
+TEST_F(TrayQtCoverageTest, ListedIconsCanBePreloadedInTheBackground) {
+  std::vector<std::byte> buf;
+  struct tray *iconPathTray = MakeIconPathTray(buf, {"icon.png", "icon2.png"});
+
+  tray_set_async_icon_preload(1);
+  struct tray_stats before {};
+  tray_get_stats(&before);
+  const int initResult = tray_init(iconPathTray);
+  trayRunning = (initResult == 0);
+  ASSERT_EQ(initResult, 0);
+
+  struct tray_stats after {};
+  const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+  do {
+    PumpEvents(1);
+    tray_get_stats(&after);
+  } while (after.icons_preloaded - before.icons_preloaded < 2U && std::chrono::steady_clock::now() < deadline);
+  EXPECT_EQ(after.icons_preloaded - before.icons_preloaded, 2U);
+}
+
+TEST_F(TrayQtCoverageTest, IconDataIsShownFromMemory) {
+  InitTray();
+
+  constexpr int size = 16;
+  std::vector<std::uint8_t> pixels(static_cast<size_t>(size) * size * 4, 0xFF);
+  struct tray_icon_data rgba {};
+  rgba.data = pixels.data();
+  rgba.size = pixels.size();
+  rgba.width = size;
+  rgba.height = size;
+
+  struct tray_stats before {};
+  tray_get_stats(&before);
+  EXPECT_EQ(tray_set_icon_data(&rgba), 0);
+
+  rgba.stride = size;
+  EXPECT_EQ(tray_set_icon_data(&rgba), -1);
+
+  const std::array<char, 4> garbage {'n', 'o', 'p', 'e'};
+  struct tray_icon_data encoded {};
+  encoded.data = garbage.data();
+  encoded.size = garbage.size();
+  EXPECT_EQ(tray_set_icon_data(&encoded), -1);
+
+  // Rejected up front instead of being truncated to a buffer that is too short
+  encoded.size = static_cast<size_t>(std::numeric_limits<int>::max()) + 1;
+  EXPECT_EQ(tray_set_icon_data(&encoded), -1);
+
+  struct tray_stats after {};
+  tray_get_stats(&after);
+  EXPECT_EQ(after.icon_data_updates - before.icon_data_updates, 1U);
+
+  EXPECT_EQ(tray_set_icon_data(nullptr), 0);
+  PumpEvents();
+}
+
+TEST_F(TrayQtCoverageTest, IconAnimationRunsOnTheApplicationThread) {
+  EXPECT_EQ(tray_set_icon_animation(nullptr, 0, 10), -1);
+  InitTray();
+
+  const std::array<const char *, 2> frames {"icon.png", "icon2.png"};
+  EXPECT_EQ(tray_set_icon_animation(frames.data(), 0, 10), -1);
+  EXPECT_EQ(tray_set_icon_animation(frames.data(), static_cast<int>(frames.size()), 0), -1);
+
+  struct tray_stats before {};
+  tray_get_stats(&before);
+  ASSERT_EQ(tray_set_icon_animation(frames.data(), static_cast<int>(frames.size()), 50), 0);
+
+  struct tray_stats after {};
+  const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+  do {
+    PumpEvents(1);
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    tray_get_stats(&after);
+  } while (after.animation_frames_shown - before.animation_frames_shown < 3U && std::chrono::steady_clock::now() < deadline);
+  EXPECT_GE(after.animation_frames_shown - before.animation_frames_shown, 3U);
+
+  tray_stop_icon_animation();
+  tray_get_stats(&before);
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  PumpEvents();
+  tray_get_stats(&after);
+  EXPECT_EQ(after.animation_frames_shown, before.animation_frames_shown);
+}
+
+TEST_F(TrayQtCoverageTest, SvgIconsAreRenderedOnce) {
+  InitTray();
+
+  const auto showIcons = [this]() {
+    for (const char *icon : {"icon.svg", "icon2.svg"}) {
+      trayData->icon = icon;
+      tray_update(trayData);
+      PumpEvents();
+    }
+  };
+  showIcons();
+
+  struct tray_stats before {};
+  tray_get_stats(&before);
+  EXPECT_GE(before.svg_renders, 2U);
+
+  showIcons();
+
+  struct tray_stats after {};
+  tray_get_stats(&after);
+  EXPECT_EQ(after.icon_updates_applied - before.icon_updates_applied, 2U);
+  EXPECT_EQ(after.svg_renders, before.svg_renders);
+  EXPECT_EQ(after.svg_render_time_us, before.svg_render_time_us);
+
+  // Large sizes are rendered from the drawing too, not scaled up from a small pixmap
+  std::array<int, 16> sizes {};
+  const int sizeCount = tray_get_icon_sizes(sizes.data(), static_cast<int>(sizes.size()));
+  ASSERT_GT(sizeCount, 0);
+  const auto end = sizes.begin() + std::min(sizeCount, static_cast<int>(sizes.size()));
+  for (const int size : {64, 128, 256}) {
+    EXPECT_NE(std::find(sizes.begin(), end, size), end) << size;
+  }
+}
+
+TEST_F(TrayQtCoverageTest, RasterizedIconsAreReusedFromTheDiskCache) {
+  const auto cacheDir = std::filesystem::temp_directory_path() / "tray-test-icon-cache";
+  std::filesystem::remove_all(cacheDir);
+  ASSERT_EQ(tray_set_icon_disk_cache(cacheDir.string().c_str()), 0);
+  EXPECT_TRUE(std::filesystem::is_directory(cacheDir));
+
+  // Use a copy nobody loaded before, so the icon misses the in-memory cache
+  const auto iconPath = cacheDir / "disk-cached-icon.svg";
+  std::filesystem::copy_file("icon.svg", iconPath);
+  const std::string icon = iconPath.string();
+  // Writing prunes cache files unused for a long time, and nothing else
+  const auto stalePath = cacheDir / "stale.pix";
+  std::ofstream(stalePath) << "stale";
+  std::filesystem::last_write_time(stalePath, std::filesystem::last_write_time(stalePath) - std::chrono::hours(24 * 60));
+  InitTray();
+
+  struct tray_stats before {};
+  tray_get_stats(&before);
+  trayData->icon = icon.c_str();
+  tray_update(trayData);
+  PumpEvents();
+
+  struct tray_stats written {};
+  tray_get_stats(&written);
+  EXPECT_EQ(written.icon_disk_cache_writes - before.icon_disk_cache_writes, 1U);
+  EXPECT_EQ(written.svg_renders - before.svg_renders, 1U);
+  EXPECT_FALSE(std::filesystem::exists(stalePath));
+  EXPECT_TRUE(std::filesystem::exists(iconPath));
+
+  // A new modification time drops the in-memory entry, the unchanged content still matches on disk
+  std::filesystem::last_write_time(iconPath, std::filesystem::last_write_time(iconPath) + std::chrono::hours(1));
+  trayData->icon = "icon.png";
+  tray_update(trayData);
+  trayData->icon = icon.c_str();
+  tray_update(trayData);
+  PumpEvents();
+
+  struct tray_stats after {};
+  tray_get_stats(&after);
+  EXPECT_EQ(after.icon_disk_cache_hits - written.icon_disk_cache_hits, 1U);
+  EXPECT_EQ(after.svg_renders, written.svg_renders);
+
+  // Background decoding reads the same disk cache
+  std::filesystem::last_write_time(iconPath, std::filesystem::last_write_time(iconPath) + std::chrono::hours(1));
+  tray_set_async_icon_decode(1);
+  trayData->icon = "icon.png";
+  tray_update(trayData);
+  trayData->icon = icon.c_str();
+  tray_update(trayData);
+  struct tray_stats async {};
+  const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+  do {
+    PumpEvents(1);
+    tray_get_stats(&async);
+  } while (async.icons_decoded_async == after.icons_decoded_async && std::chrono::steady_clock::now() < deadline);
+  EXPECT_EQ(async.icon_disk_cache_hits - after.icon_disk_cache_hits, 1U);
+  EXPECT_EQ(async.svg_renders, written.svg_renders);
+
+  tray_exit();
+  tray_loop(0);
+  trayRunning = false;
+  tray_set_icon_disk_cache(nullptr);
+  std::filesystem::remove_all(cacheDir);
+}
+
+TEST_F(TrayQtCoverageTest, BadgesAreCachedPerIconAndValue) {
+  InitTray();
+
+  struct tray_stats before {};
+  tray_get_stats(&before);
+  tray_set_badge(3);
+  tray_set_badge(4);
+  tray_set_badge(3);
+  tray_set_badge(3);
+
+  struct tray_stats after {};
+  tray_get_stats(&after);
+  EXPECT_EQ(after.badge_composites_rendered - before.badge_composites_rendered, 2U);
+  EXPECT_EQ(after.badge_composites_reused - before.badge_composites_reused, 1U);
+
+  trayData->icon = "icon2.png";
+  tray_update(trayData);
+  PumpEvents();
+  tray_set_badge_text("!");
+  tray_set_badge(0);
+
+  tray_get_stats(&after);
+  EXPECT_EQ(after.badge_composites_rendered - before.badge_composites_rendered, 4U);
+}
+
+TEST_F(TrayQtCoverageTest, ThemeLookupsAreMemoizedIncludingMisses) {
+  InitTray();
+
+  struct tray_stats before {};
+  tray_get_stats(&before);
+  for (const char *icon : {"tray-test-unresolvable-icon", "icon.png", "tray-test-unresolvable-icon"}) {
+    trayData->icon = icon;
+    tray_update(trayData);
+    PumpEvents();
+  }
+
+  struct tray_stats after {};
+  tray_get_stats(&after);
+  EXPECT_EQ(after.theme_icon_misses - before.theme_icon_misses, 1U);
+  EXPECT_EQ(after.theme_icon_hits - before.theme_icon_hits, 1U);
+}
+
+TEST_F(TrayQtCoverageTest, IconFilesCanBeDecodedInTheBackground) {
+  // Use a copy nobody loaded before, so the icon misses the in-memory cache
+  const auto iconPath = std::filesystem::temp_directory_path() / "tray-test-async-icon.png";
+  std::filesystem::copy_file("icon2.png", iconPath, std::filesystem::copy_options::overwrite_existing);
+  std::filesystem::last_write_time(iconPath, std::filesystem::file_time_type::clock::now());
+  const std::string icon = iconPath.string();
+
+  tray_set_async_icon_decode(1);
+  InitTray();
+
+  struct tray_stats before {};
+  tray_get_stats(&before);
+  trayData->icon = icon.c_str();
+  tray_update(trayData);
+
+  struct tray_stats after {};
+  const auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+  do {
+    PumpEvents(1);
+    tray_get_stats(&after);
+  } while (after.icons_decoded_async == before.icons_decoded_async && std::chrono::steady_clock::now() < deadline);
+  EXPECT_EQ(after.icons_decoded_async - before.icons_decoded_async, 1U);
+  EXPECT_EQ(after.icon_updates_applied - before.icon_updates_applied, 1U);
+
+  // Switching back to a cached icon is applied right away
+  trayData->icon = "icon.png";
+  tray_update(trayData);
+  tray_get_stats(&after);
+  EXPECT_EQ(after.icon_updates_applied - before.icon_updates_applied, 2U);
+
+  tray_exit();
+  tray_loop(0);
+  trayRunning = false;
+  std::filesystem::remove(iconPath);
+}
+
+TEST_F(TrayQtCoverageTest, ListedIconVariantsAreCombined) {
+#if defined(__linux__) || defined(__APPLE__)
+  const auto variantDir = std::filesystem::temp_directory_path() / "tray-test-icon-variants";
+  std::filesystem::remove_all(variantDir);
+  std::filesystem::create_directories(variantDir);
+  const auto writeIcon = [&variantDir](const char *name, int size) {
+    QImage image(size, size, QImage::Format_ARGB32);
+    image.fill(Qt::red);
+    const std::string path = (variantDir / name).string();
+    EXPECT_TRUE(image.save(QString::fromStdString(path), "PNG"));
+    return path;
+  };
+  const std::string plain = writeIcon("variant.png", 16);
+  const std::string doubled = writeIcon("variant@2x.png", 32);
+  const std::string sized = writeIcon("variant-22.png", 22);
+  // Numbered like a size, but an animation frame of another size
+  const std::string frame = writeIcon("variant-1.png", 64);
+
+  std::vector<std::byte> buf;
+  struct tray *iconPathTray = MakeIconPathTray(buf, {plain.c_str(), doubled.c_str(), sized.c_str(), frame.c_str()});
+  iconPathTray->icon = plain.c_str();
+
+  struct tray_stats before {};
+  tray_get_stats(&before);
+  const int initResult = tray_init(iconPathTray);
+  trayRunning = (initResult == 0);
+  ASSERT_EQ(initResult, 0);
+
+  struct tray_stats after {};
+  tray_get_stats(&after);
+  EXPECT_EQ(after.icon_variants_combined - before.icon_variants_combined, 3U);
+  // Every listed file is decoded once, and the tray icon comes from the combined variants
+  EXPECT_EQ(after.icon_cache_misses - before.icon_cache_misses, 4U);
+  EXPECT_EQ(after.icon_cache_hits, before.icon_cache_hits);
+
+  std::array<int, 8> sizes {};
+  const int sizeCount = tray_get_icon_sizes(sizes.data(), static_cast<int>(sizes.size()));
+  ASSERT_GT(sizeCount, 0);
+  const auto end = sizes.begin() + std::min(sizeCount, static_cast<int>(sizes.size()));
+  EXPECT_NE(std::find(sizes.begin(), end, 16), end);
+  EXPECT_NE(std::find(sizes.begin(), end, 22), end);
+  EXPECT_EQ(std::find(sizes.begin(), end, 64), end);
+
+  int width = 0;
+  double pixelRatio = 0;
+  ASSERT_EQ(tray_get_icon_pixmap(16, 1.0, &width, &pixelRatio), 0);
+  EXPECT_EQ(width, 16);
+  EXPECT_DOUBLE_EQ(pixelRatio, 1.0);
+  if (tray_get_icon_pixmap(16, 2.0, &width, &pixelRatio) == 0) {
+    EXPECT_EQ(width, 32);
+    EXPECT_DOUBLE_EQ(pixelRatio, 2.0);
+  }
+
+  // Editing one variant combines the whole group again from the current files
+  std::filesystem::last_write_time(sized, std::filesystem::last_write_time(sized) + std::chrono::hours(1));
+  tray_get_stats(&before);
+  tray_update(iconPathTray);
+  PumpEvents();
+  tray_get_stats(&after);
+  EXPECT_EQ(after.icon_variants_combined - before.icon_variants_combined, 3U);
+  EXPECT_EQ(tray_get_icon_sizes(sizes.data(), static_cast<int>(sizes.size())), sizeCount);
+
+  tray_exit();
+  tray_loop(0);
+  trayRunning = false;
+  std::filesystem::remove_all(variantDir);
+#else
+  GTEST_SKIP() << "Icon fixtures are generated with Qt, which the tests only link on Linux and macOS";
+#endif
+}